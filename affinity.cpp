@@ -0,0 +1,160 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "affinity.h"
+#include "utils.h"
+
+using namespace std;
+
+
+#define NODEPATH "/sys/devices/system/node"
+
+// parse a CPU list like "0-3,8,10-11"
+void parseCPUList(const string& s, vector<int>& cpus)
+{
+	istringstream ss(s);
+	string range;
+	while (getline(ss, range, ','))
+	{
+		int first, last;
+		char dash;
+		istringstream rs(range);
+		if (!(rs >> first))
+			continue;
+		if (rs >> dash >> last && dash == '-')
+			for (int i = first; i <= last; i++)
+				cpus.push_back(i);
+		else
+			cpus.push_back(first);
+	}
+}
+
+// get the NUMA node directories ("/sys/devices/system/node/node0", etc.) and their node numbers
+void getNodeDirs(map<int, string>& nodedirs)
+{
+	vector<string> entries;
+	listEntries(NODEPATH, entries);
+	for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); it++)
+	{
+		string name = it->substr(it->rfind('/') + 1);
+		int node;
+		if (name.compare(0, 4, "node") == 0 && fromstring(name.substr(4), node))
+			nodedirs[node] = *it;
+	}
+}
+
+vector<CPUPlacement> getCPUPlacements()
+{
+	vector<CPUPlacement> placements;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (0 != sched_getaffinity(0, sizeof(allowed), &allowed))
+		return placements;
+
+	// find out which CPUs are on which node; if we can't tell, put them all on node 0
+	map<int, int> cpunodes;
+	map<int, string> nodedirs;
+	getNodeDirs(nodedirs);
+	for (map<int, string>::const_iterator it = nodedirs.begin(); it != nodedirs.end(); it++)
+	{
+		vector<string> lines;
+		vector<int> cpus;
+		if (readLines(it->second + "/cpulist", lines) && !lines.empty())
+			parseCPUList(lines[0], cpus);
+		for (vector<int>::const_iterator cit = cpus.begin(); cit != cpus.end(); cit++)
+			cpunodes[*cit] = it->first;
+	}
+	map<int, vector<int> > nodecpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed))
+			nodecpus[cpunodes.count(cpu) ? cpunodes[cpu] : 0].push_back(cpu);
+
+	// deal the CPUs out one node at a time
+	for (size_t i = 0; ; i++)
+	{
+		bool any = false;
+		for (map<int, vector<int> >::const_iterator it = nodecpus.begin(); it != nodecpus.end(); it++)
+			if (i < it->second.size())
+			{
+				placements.push_back(CPUPlacement(it->second[i], it->first));
+				any = true;
+			}
+		if (!any)
+			break;
+	}
+#endif
+	return placements;
+}
+
+bool pinThread(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+	return false;
+#endif
+}
+
+NUMAStats NUMAStats::operator-(const NUMAStats& ns) const
+{
+	NUMAStats result = *this;
+	result.hit -= ns.hit;
+	result.miss -= ns.miss;
+	result.foreign -= ns.foreign;
+	result.othernode -= ns.othernode;
+	return result;
+}
+
+NUMAStats readNUMAStats()
+{
+	NUMAStats stats;
+	map<int, string> nodedirs;
+	getNodeDirs(nodedirs);
+	for (map<int, string>::const_iterator it = nodedirs.begin(); it != nodedirs.end(); it++)
+	{
+		ifstream infile((it->second + "/numastat").c_str());
+		if (infile.fail())
+			return NUMAStats();
+		string name;
+		int64_t value;
+		while (infile >> name >> value)
+		{
+			if (name == "numa_hit")
+				stats.hit += value;
+			else if (name == "numa_miss")
+				stats.miss += value;
+			else if (name == "numa_foreign")
+				stats.foreign += value;
+			else if (name == "other_node")
+				stats.othernode += value;
+		}
+		stats.nodes++;
+	}
+	stats.available = stats.nodes > 0;
+	return stats;
+}
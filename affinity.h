@@ -0,0 +1,57 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <vector>
+#include <stdint.h>
+
+// thread placement on machines with more than one NUMA node (i.e. multiple sockets): the node layout
+//  is read from /sys, so this only does anything on Linux; elsewhere, there's a single node and
+//  pinning always fails
+
+struct CPUPlacement
+{
+	int cpu;
+	int node;
+
+	CPUPlacement(int c, int n) : cpu(c), node(n) {}
+};
+
+// get the CPUs this process may run on, ordered so that consecutive entries alternate between NUMA nodes
+//  (so the first few threads are spread across all the nodes, rather than filling up the first one)
+std::vector<CPUPlacement> getCPUPlacements();
+
+// pin the calling thread to a single CPU; returns false if that's not possible
+bool pinThread(int cpu);
+
+// system-wide counts of page allocations, summed over all the nodes
+// ..."miss" is memory that was meant for one node but ended up on another; "othernode" is memory that
+//  was allocated on one node for a process running on another
+struct NUMAStats
+{
+	bool available;
+	int nodes;
+	int64_t hit, miss, foreign, othernode;
+
+	NUMAStats() : available(false), nodes(0), hit(0), miss(0), foreign(0), othernode(0) {}
+	NUMAStats operator-(const NUMAStats& ns) const;
+};
+
+NUMAStats readNUMAStats();
+
+
+#endif // AFFINITY_H
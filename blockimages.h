@@ -92,6 +92,8 @@ struct BlockImages
 	//  on the blockID/blockData; for those, the renderer just has to know the proper offsets on its own
 	int blockOffsets[4096 * 16];
 	int getOffset(uint16_t blockID, uint8_t blockData) const {return blockOffsets[blockID * 16 + blockData];}
+	// ...or from ID << 4 | data together (as returned by ChunkData::block)
+	int getOffset(uint16_t block) const {return blockOffsets[block];}
 
 	// check whether a block image is opaque (this is a function of the block images computed from the terrain,
 	//  not of the actual block data; if a block image has 100% alpha everywhere, it's considered opaque)
@@ -18,10 +18,15 @@
 #include <stdint.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <memory>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "chunk.h"
+#include "decoder.h"
 #include "utils.h"
 
 using namespace std;
@@ -31,7 +36,60 @@ using namespace std;
 //---------------------------------------------------------------------------------------------------
 
 
-bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
+template <class Section> Section ChunkDataT<Section>::emptySection;  // (zero-initialized, so all air)
+
+bool SplitBlockSection::empty() const
+{
+	return count(blockIDs, blockIDs + 4096, 0) == 4096 && count(blockData, blockData + 2048, 0) == 2048;
+}
+
+bool FusedBlockSection::empty() const
+{
+	return count(blocks, blocks + 4096, 0) == 4096;
+}
+
+template <class Section> void ChunkDataT<Section>::swap(ChunkDataT& cd)
+{
+	// (the section pointers stay good, since swapping the vectors doesn't move their elements)
+	storage.swap(cd.storage);
+	swap_ranges(sections, sections + 16, cd.sections);
+	std::swap(sectionMask, cd.sectionMask);
+	swap_ranges(heights, heights + 256, cd.heights);
+	std::swap(anvil, cd.anvil);
+}
+
+template <class Section> ChunkDataT<Section>& ChunkDataT<Section>::operator=(const ChunkDataT& cd)
+{
+	storage = cd.storage;
+	copy(cd.heights, cd.heights + 256, heights);
+	anvil = cd.anvil;
+	sectionMask = cd.sectionMask;
+	for (int i = 0; i < 16; i++)
+		sections[i] = (cd.sections[i] == &emptySection) ? &emptySection : &storage[cd.sections[i] - &cd.storage[0]];
+	return *this;
+}
+
+template <class Section> void ChunkDataT<Section>::computeHeights()
+{
+	// work down from the top until every column has found its highest block (or we run out of sections)
+	fill(heights, heights + 256, 0);
+	int remaining = 256;
+	for (int sy = 15; sy >= 0 && remaining > 0; sy--)
+	{
+		if (!(sectionMask & (1 << sy)))
+			continue;
+		const Section *section = sections[sy];
+		for (int y = 15; y >= 0 && remaining > 0; y--)
+			for (int i = 0; i < 256; i++)
+				if (heights[i] == 0 && section->id(y * 256 + i) != 0)
+				{
+					heights[i] = sy * 16 + y + 1;
+					remaining--;
+				}
+	}
+}
+
+template <class Section> bool ChunkDataT<Section>::loadFromOldFile(const vector<uint8_t>& filebuf, uint16_t wanted)
 {
 	anvil = false;
 	// the hell with parsing this whole godforsaken NBT format; just look for the arrays we need
@@ -39,8 +97,17 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 	uint8_t dataTag[11] = {7, 0, 4, 'D', 'a', 't', 'a', 0, 0, 64, 0};
 	bool foundIDs = false, foundData = false;
 
-	fill(blockIDs, blockIDs + 65536, 0);
-	fill(blockData, blockData + 32768, 0);
+	// old-style chunks are 128 high; start with all eight sections, and drop the empty ones at the end
+	clear();
+	// (all of them get filled in, since the arrays aren't split up by section; unwanted ones are dropped
+	//  along with the empty ones)
+	storage.resize(8);
+	for (int i = 0; i < 8; i++)
+	{
+		storage[i].clear();
+		sections[i] = &storage[i];
+	}
+	sectionMask = 0xff;
 	
 	for (vector<uint8_t>::const_iterator it = filebuf.begin(); it != filebuf.end(); it++)
 	{
@@ -55,8 +122,8 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 					for (unsigned y = 0; y < 128; ++y)
 					{
 						unsigned oldloc = (x * 16 + z) * 128 + y;
-						unsigned newloc = (y * 16 + z) * 16 + x;
-						blockIDs[newloc] = *(it + 13 + oldloc);
+						unsigned newloc = ((y & 0xf) * 16 + z) * 16 + x;
+						storage[y >> 4].setID(newloc, *(it + 13 + oldloc));
 					}
 				}
 			}
@@ -78,12 +145,8 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 						else
 							data = (data & 0xf0) >> 4;
 						
-						unsigned newloc = (y * 16 + z) * 16 + x;
-						uint8_t& writeloc = blockData[newloc / 2];
-						if (newloc % 2 == 0)
-							writeloc = (writeloc & 0xf0) | data;
-						else
-							writeloc = (writeloc & 0xf) | (data << 4);
+						unsigned newloc = ((y & 0xf) * 16 + z) * 16 + x;
+						storage[y >> 4].setData(newloc, data);
 					}
 				}
 			}
@@ -91,7 +154,16 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 			foundData = true;
 		}
 		if (foundIDs && foundData)
+		{
+			for (int i = 0; i < 8; i++)
+				if (!(wanted & (1 << i)) || storage[i].empty())
+				{
+					sections[i] = &emptySection;
+					sectionMask &= ~(1 << i);
+				}
+			computeHeights();
 			return true;
+		}
 	}
 	return false;
 }
@@ -102,6 +174,8 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 
 // quasi-NBT-parsing stuff for Anvil format: doesn't actually bother trying to read the whole thing,
 //  just skips through the data looking for what we're interested in
+// ...nothing is copied out of the buffer while scanning (tag names are compared where they lie), and every
+//  read is checked against the end of the buffer, so corrupt data just makes the parse fail
 #define TAG_END            0
 #define TAG_BYTE           1
 #define TAG_SHORT          2
@@ -114,205 +188,391 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 #define TAG_LIST           9
 #define TAG_COMPOUND       10
 #define TAG_INT_ARRAY      11
+#define TAG_LONG_ARRAY     12
+
+#define NBTMAXDEPTH 512  // give up on anything nested deeper than this, rather than overflowing the stack
 
-// although tag names are UTF8, we'll just pretend they're ASCII--we don't really care about how the
-//  actual string data breaks down into characters, as long as we know where the end of the string is
-void parseTypeAndName(const uint8_t*& ptr, uint8_t& type, string& name)
+struct NBTScanner
 {
-	type = *ptr;
-	ptr++;
-	if (type != TAG_END)
+	const uint8_t *ptr, *end;
+
+	NBTScanner(const uint8_t *start, const uint8_t *e) : ptr(start), end(e) {}
+
+	bool skip(uint64_t n) {if ((uint64_t)(end - ptr) < n) return false; ptr += n; return true;}
+	bool readByte(uint8_t& b) {if (ptr == end) return false; b = *ptr++; return true;}
+	bool readShort(uint16_t& s)
 	{
-		uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-		name.resize(len);
-		copy(ptr + 2, ptr + 2 + len, name.begin());
-		ptr += 2 + len;
+		if (end - ptr < 2)
+			return false;
+		s = (ptr[0] << 8) | ptr[1];
+		ptr += 2;
+		return true;
+	}
+	bool readInt(uint32_t& i)
+	{
+		if (end - ptr < 4)
+			return false;
+		i = ((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+		ptr += 4;
+		return true;
 	}
-}
 
-// structure for locating the block data for a 16x16x16 section--the compound tags on the "Sections" list will pass
-//  this down to their immediate children, so they can fill in pointers to their payloads if appropriate
-// ...after the whole structure is parsed, the block data will be copied into the ChunkData
-// (note that we can't read the block data immediately upon finding it, because we have to know the Y value
-//  for the section first, and the tags may appear in any order)
-struct chunkSection
-{
-	int y;  // or -1 for "not found yet"
-	const uint8_t *blockIDs;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockData;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockAdd;  // pointer into the file buffer, or NULL for "not found" (this one may not be present at all)
+	// read a tag's type and name (unless it's TAG_END, which has no name); the name is left in the buffer
+	// although tag names are UTF8, we'll just pretend they're ASCII--we don't really care about how the
+	//  actual string data breaks down into characters, as long as we know where the end of the string is
+	bool readTypeAndName(uint8_t& type, const uint8_t*& name, uint16_t& namelen)
+	{
+		namelen = 0;
+		if (!readByte(type))
+			return false;
+		if (type == TAG_END)
+			return true;
+		if (!readShort(namelen))
+			return false;
+		name = ptr;
+		return skip(namelen);
+	}
 
-	chunkSection() : y(-1), blockIDs(NULL), blockData(NULL), blockAdd(NULL) {}
-	bool complete() const {return y >= 0 && y < 16 && blockIDs != NULL && blockData != NULL;}
-	
-	void extract(ChunkData& chunkdata) const
+	// size of a payload that's always the same size, or -1 for the variable-size ones
+	static int fixedSize(uint8_t type)
+	{
+		switch (type)
+		{
+			case TAG_END: return 0;
+			case TAG_BYTE: return 1;
+			case TAG_SHORT: return 2;
+			case TAG_INT: case TAG_FLOAT: return 4;
+			case TAG_LONG: case TAG_DOUBLE: return 8;
+		}
+		return -1;
+	}
+
+	// move past a payload we don't care about; arrays, strings, and lists of fixed-size things are skipped
+	//  in one step, but compounds (and lists of them) have to be walked, since NBT doesn't record their sizes
+	bool skipPayload(uint8_t type, int depth = 0)
 	{
-		uint16_t* destination = chunkdata.blockIDs + (y * 4096);
-		for (unsigned i = 0; i < 4096; ++i)
+		int size = fixedSize(type);
+		if (size >= 0)
+			return skip(size);
+		uint32_t len;
+		uint16_t slen;
+		switch (type)
 		{
-			uint16_t val = blockIDs[i];
-			if (blockAdd)
+			case TAG_BYTE_ARRAY: return readInt(len) && skip(len);
+			case TAG_INT_ARRAY: return readInt(len) && skip((uint64_t)len * 4);
+			case TAG_LONG_ARRAY: return readInt(len) && skip((uint64_t)len * 8);
+			case TAG_STRING: return readShort(slen) && skip(slen);
+			case TAG_LIST:
 			{
-				if (i % 2 == 0)
-					val |= (blockAdd[i / 2] & 0xf) << 8;
-				else
-					val |= (blockAdd[i / 2] & 0xf0) << 4;
+				uint8_t listtype;
+				if (!readByte(listtype) || !readInt(len) || depth >= NBTMAXDEPTH)
+					return false;
+				size = fixedSize(listtype);
+				if (size >= 0)
+					return skip((uint64_t)len * size);
+				for (uint32_t i = 0; i < len; i++)
+					if (!skipPayload(listtype, depth + 1))
+						return false;
+				return true;
+			}
+			case TAG_COMPOUND:
+			{
+				if (depth >= NBTMAXDEPTH)
+					return false;
+				uint8_t nexttype;
+				const uint8_t *name;
+				uint16_t namelen;
+				while (readTypeAndName(nexttype, name, namelen))
+				{
+					if (nexttype == TAG_END)
+						return true;
+					if (!skipPayload(nexttype, depth + 1))
+						return false;
+				}
+				return false;
 			}
-			destination[i] = val;
 		}
-		copy(blockData, blockData + 2048, chunkdata.blockData + (y * 2048));
+		// unknown tag--since we have no idea how large it is, we must abort
+		cerr << "unknown NBT tag: type " << (int)type << endl;
+		return false;
 	}
 };
 
-bool isSection(const vector<string>& names)
+bool nameIs(const uint8_t *name, uint16_t namelen, const char *s)
 {
-	return names.size() == 4 &&
-	       names[3] == "" &&
-	       names[2] == "Sections" &&
-	       names[1] == "Level" &&
-	       names[0] == "";
+	return namelen == strlen(s) && 0 == memcmp(name, s, namelen);
 }
 
-// if section != NULL, then the immediate parent of this tag is one of the compound tags in the "Sections"
-//  list, so the block data tags will fill in their locations
-bool parsePayload(const uint8_t*& ptr, uint8_t type, vector<string>& names, chunkSection *section, vector<chunkSection>& completedSections)
+// the Add array holds the upper 4 bits of each ID, two blocks per byte: the low nibble for the even
+//  block, the high one for the odd block
+void extractBlockIDsPlain(const uint8_t *blockIDs, const uint8_t *blockAdd, uint16_t *dest)
 {
-	switch (type)
+	if (blockAdd == NULL)
 	{
-		case TAG_END:
-		{
-			return true;
-		}
-		case TAG_BYTE:
-		{
-			if (section != NULL && names.back() == "Y")
-				section->y = *ptr;
-			ptr++;
-			return true;
-		}
-		case TAG_SHORT:
+		copy(blockIDs, blockIDs + 4096, dest);
+		return;
+	}
+	for (int i = 0; i < 4096; i += 2)
+	{
+		dest[i] = blockIDs[i] | ((blockAdd[i / 2] & 0xf) << 8);
+		dest[i + 1] = blockIDs[i + 1] | ((blockAdd[i / 2] & 0xf0) << 4);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define HAVE_SIMD_EXTRACT 1
+
+// for both of these: split each Add byte into its two nibbles, then interleave them, so there's one
+//  nibble per byte in block order
+// (x86 is little-endian, so interleaving the ID bytes with the nibble bytes produces 16-bit IDs)
+
+__attribute__((target("sse2")))
+void extractBlockIDsSSE2(const uint8_t *blockIDs, const uint8_t *blockAdd, uint16_t *dest)
+{
+	const __m128i zero = _mm_setzero_si128();
+	if (blockAdd == NULL)
+	{
+		for (int i = 0; i < 4096; i += 16)
 		{
-			ptr += 2;
-			return true;
+			__m128i ids = _mm_loadu_si128((const __m128i*)(blockIDs + i));
+			_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi8(ids, zero));
+			_mm_storeu_si128((__m128i*)(dest + i + 8), _mm_unpackhi_epi8(ids, zero));
 		}
-		case TAG_INT:
-		case TAG_FLOAT:
+		return;
+	}
+	const __m128i mask = _mm_set1_epi8(0xf);
+	for (int i = 0; i < 4096; i += 32)
+	{
+		__m128i add = _mm_loadu_si128((const __m128i*)(blockAdd + i / 2));
+		__m128i lo = _mm_and_si128(add, mask), hi = _mm_and_si128(_mm_srli_epi16(add, 4), mask);
+		__m128i nibbles0 = _mm_unpacklo_epi8(lo, hi), nibbles1 = _mm_unpackhi_epi8(lo, hi);
+		__m128i ids0 = _mm_loadu_si128((const __m128i*)(blockIDs + i));
+		__m128i ids1 = _mm_loadu_si128((const __m128i*)(blockIDs + i + 16));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi8(ids0, nibbles0));
+		_mm_storeu_si128((__m128i*)(dest + i + 8), _mm_unpackhi_epi8(ids0, nibbles0));
+		_mm_storeu_si128((__m128i*)(dest + i + 16), _mm_unpacklo_epi8(ids1, nibbles1));
+		_mm_storeu_si128((__m128i*)(dest + i + 24), _mm_unpackhi_epi8(ids1, nibbles1));
+	}
+}
+
+// (the 256-bit unpacks work within 128-bit lanes, which would scramble the order, so this widens
+//  16 bytes at a time instead)
+__attribute__((target("avx2")))
+void extractBlockIDsAVX2(const uint8_t *blockIDs, const uint8_t *blockAdd, uint16_t *dest)
+{
+	if (blockAdd == NULL)
+	{
+		for (int i = 0; i < 4096; i += 32)
 		{
-			ptr += 4;
-			return true;
+			_mm256_storeu_si256((__m256i*)(dest + i), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(blockIDs + i))));
+			_mm256_storeu_si256((__m256i*)(dest + i + 16), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(blockIDs + i + 16))));
 		}
-		case TAG_LONG:
-		case TAG_DOUBLE:
+		return;
+	}
+	const __m128i mask = _mm_set1_epi8(0xf);
+	for (int i = 0; i < 4096; i += 32)
+	{
+		__m128i add = _mm_loadu_si128((const __m128i*)(blockAdd + i / 2));
+		__m128i lo = _mm_and_si128(add, mask), hi = _mm_and_si128(_mm_srli_epi16(add, 4), mask);
+		__m256i nibbles0 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(lo, hi));
+		__m256i nibbles1 = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(lo, hi));
+		__m256i ids0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(blockIDs + i)));
+		__m256i ids1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(blockIDs + i + 16)));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_or_si256(ids0, _mm256_slli_epi16(nibbles0, 8)));
+		_mm256_storeu_si256((__m256i*)(dest + i + 16), _mm256_or_si256(ids1, _mm256_slli_epi16(nibbles1, 8)));
+	}
+}
+
+#endif
+
+typedef void (*ExtractBlockIDsFunc)(const uint8_t*, const uint8_t*, uint16_t*);
+
+ExtractBlockIDsFunc chooseExtractBlockIDs()
+{
+#ifdef HAVE_SIMD_EXTRACT
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return extractBlockIDsAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return extractBlockIDsSSE2;
+#endif
+	return extractBlockIDsPlain;
+}
+
+void extractBlockIDs(const uint8_t *blockIDs, const uint8_t *blockAdd, uint16_t *dest)
+{
+	static ExtractBlockIDsFunc extract = chooseExtractBlockIDs();
+	extract(blockIDs, blockAdd, dest);
+}
+
+void SplitBlockSection::extract(const uint8_t *ids, const uint8_t *add, const uint8_t *data)
+{
+	extractBlockIDs(ids, add, blockIDs);
+	copy(data, data + 2048, blockData);
+}
+
+void FusedBlockSection::extract(const uint8_t *ids, const uint8_t *add, const uint8_t *data)
+{
+	extractBlockIDs(ids, add, blocks);
+	for (int i = 0; i < 4096; i += 2)
+	{
+		blocks[i] = (blocks[i] << 4) | (data[i / 2] & 0xf);
+		blocks[i + 1] = (blocks[i + 1] << 4) | (data[i / 2] >> 4);
+	}
+}
+
+// structure for locating the block data for a 16x16x16 section--filled in from the tags of one of the compounds
+//  in the "Sections" list
+// ...after the whole structure is parsed, the block data will be extracted into the ChunkData's sections
+// (note that we can't read the block data immediately upon finding it, because we have to know the Y value
+//  for the section first, and the tags may appear in any order)
+struct chunkSection
+{
+	int y;  // or -1 for "not found yet"
+	const uint8_t *blockIDs;  // pointer into the file buffer, or NULL for "not found yet"
+	const uint8_t *blockData;  // pointer into the file buffer, or NULL for "not found yet"
+	const uint8_t *blockAdd;  // pointer into the file buffer, or NULL for "not found" (this one may not be present at all)
+
+	chunkSection() : y(-1), blockIDs(NULL), blockData(NULL), blockAdd(NULL) {}
+	bool complete() const {return y >= 0 && y < 16 && blockIDs != NULL && blockData != NULL;}
+};
+
+// scan the payload of one of the compounds in the "Sections" list
+bool scanSection(NBTScanner& nbt, chunkSection& section)
+{
+	uint8_t type;
+	const uint8_t *name;
+	uint16_t namelen;
+	while (nbt.readTypeAndName(type, name, namelen))
+	{
+		if (type == TAG_END)
 		{
-			ptr += 8;
-			return true;
+			if (section.complete())
+				return true;
+			cerr << "incomplete chunk section!" << endl;
+			return false;
 		}
-		case TAG_BYTE_ARRAY:
+		if (type == TAG_BYTE && nameIs(name, namelen, "Y"))
 		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			if (section != NULL)
-			{
-				if (names.back() == "Blocks" && len == 4096)
-					section->blockIDs = ptr;
-				else if (names.back() == "Data" && len == 2048)
-					section->blockData = ptr;
-				else if (names.back() == "Add" && len == 2048)
-					section->blockAdd = ptr;
-			}
-			ptr += len;
-			return true;
+			uint8_t y;
+			if (!nbt.readByte(y))
+				return false;
+			section.y = y;
 		}
-		case TAG_INT_ARRAY:
+		else if (type == TAG_BYTE_ARRAY && namelen <= 6)
 		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4 + len*4;
-			return true;
+			const uint8_t *payload = nbt.ptr + 4;
+			uint32_t len;
+			if (!nbt.readInt(len) || !nbt.skip(len))
+				return false;
+			if (len == 4096 && nameIs(name, namelen, "Blocks"))
+				section.blockIDs = payload;
+			else if (len == 2048 && nameIs(name, namelen, "Data"))
+				section.blockData = payload;
+			else if (len == 2048 && nameIs(name, namelen, "Add"))
+				section.blockAdd = payload;
 		}
-		case TAG_STRING:
-		{
-			uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-			ptr += 2 + len;
+		else if (!nbt.skipPayload(type))
+			return false;
+	}
+	return false;
+}
+
+// scan the payload of the "Level" compound, filling in the sections by Y
+bool scanLevel(NBTScanner& nbt, chunkSection sections[16])
+{
+	uint8_t type;
+	const uint8_t *name;
+	uint16_t namelen;
+	while (nbt.readTypeAndName(type, name, namelen))
+	{
+		if (type == TAG_END)
 			return true;
-		}
-		case TAG_LIST:
+		// (an empty list may have some other type, and can just be skipped)
+		if (type == TAG_LIST && nameIs(name, namelen, "Sections") && nbt.ptr != nbt.end && *nbt.ptr == TAG_COMPOUND)
 		{
-			uint8_t listtype = *ptr;
-			ptr++;
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			stackPusher<string> sp(names, "");
+			uint32_t len;
+			if (!nbt.skip(1) || !nbt.readInt(len))
+				return false;
 			for (uint32_t i = 0; i < len; i++)
-				if (!parsePayload(ptr, listtype, names, NULL, completedSections))
-					return false;
-			return true;
-		}
-		case TAG_COMPOUND:
-		{
-			chunkSection section;
-			chunkSection *sectionPtr = isSection(names) ? &section : NULL;
-			
-			uint8_t nexttype;
-			string nextname;
-			parseTypeAndName(ptr, nexttype, nextname);
-			while (nexttype != TAG_END)
 			{
-				stackPusher<string> sp(names, nextname);
-				if (!parsePayload(ptr, nexttype, names, sectionPtr, completedSections))
-					return false;
-				parseTypeAndName(ptr, nexttype, nextname);
-			}
-			
-			if (sectionPtr != NULL)
-			{
-				if (section.complete())
-					completedSections.push_back(section);
-				else
-				{
-					cerr << "incomplete chunk section!" << endl;
+				chunkSection section;
+				if (!scanSection(nbt, section))
 					return false;
-				}
+				sections[section.y] = section;
 			}
-
-			return true;
 		}
-		default:
-		{
-			// unknown tag--since we have no idea how large it is, we must abort
-			cerr << "unknown NBT tag: type " << type << endl;
+		else if (!nbt.skipPayload(type))
 			return false;
-		}
 	}
-	return false;  // shouldn't be able to reach here
+	return false;
 }
 
-bool ChunkData::loadFromAnvilFile(const vector<uint8_t>& filebuf)
+template <class Section> bool ChunkDataT<Section>::loadFromAnvilFile(const vector<uint8_t>& filebuf, uint16_t wanted)
 {
 	anvil = true;
-	fill(blockIDs, blockIDs + 65536, 0);
-	fill(blockData, blockData + 32768, 0);
+	clear();
 
-	const uint8_t *ptr = &(filebuf[0]);
-	uint8_t type;
-	string name;
-	parseTypeAndName(ptr, type, name);
-	if (type != TAG_COMPOUND || !name.empty())
+	if (filebuf.empty())
+		return false;
+	NBTScanner nbt(&(filebuf[0]), &(filebuf[0]) + filebuf.size());
+	uint8_t type = TAG_END;
+	const uint8_t *name;
+	uint16_t namelen = 0;
+	if (!nbt.readTypeAndName(type, name, namelen) || type != TAG_COMPOUND || namelen != 0)
 	{
-		cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name " << name << endl;
+		cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name length " << namelen << endl;
 		return false;
 	}
 
-	vector<string> names(1, name);
-	vector<chunkSection> completedSections;
-	if (!parsePayload(ptr, type, names, NULL, completedSections))
-		return false;
+	// go through the top-level compound, looking for "Level"; everything else is skipped
+	chunkSection found[16];
+	bool done = false;
+	while (!done)
+	{
+		if (!nbt.readTypeAndName(type, name, namelen))
+			return false;
+		if (type == TAG_END)
+			done = true;
+		else if (type == TAG_COMPOUND && nameIs(name, namelen, "Level"))
+		{
+			if (!scanLevel(nbt, found))
+				return false;
+		}
+		else if (!nbt.skipPayload(type))
+			return false;
+	}
 
-	for (vector<chunkSection>::const_iterator it = completedSections.begin(); it != completedSections.end(); it++)
-		it->extract(*this);
+	// sections that aren't in the file are all air, so they stay empty, as do the ones we don't want
+	// (don't set the pointers until storage is done growing)
+	for (int y = 0; y < 16; y++)
+		if (found[y].complete() && (wanted & (1 << y)))
+			sectionMask |= 1 << y;
+	storage.resize(__builtin_popcount(sectionMask));
+	for (int y = 0, i = 0; y < 16; y++)
+		if (sectionMask & (1 << y))
+			storage[i++].extract(found[y].blockIDs, found[y].blockAdd, found[y].blockData);
+	for (int y = 0, i = 0; y < 16; y++)
+		if (sectionMask & (1 << y))
+			sections[y] = &storage[i++];
+	computeHeights();
 
 	return true;
 }
 
+template struct ChunkDataT<SplitBlockSection>;
+template struct ChunkDataT<FusedBlockSection>;
+
+uint16_t sectionsForYRange(const MapParams& mp)
+{
+	int bottom = max(mp.minY - 1, 0) >> 4, top = min(mp.maxY + 1, 255) >> 4;
+	uint16_t mask = 0;
+	for (int sy = bottom; sy <= top; sy++)
+		mask |= 1 << sy;
+	return mask;
+}
+
 
 //---------------------------------------------------------------------------------------------------
 
@@ -326,56 +586,272 @@ ChunkCacheStats& ChunkCacheStats::operator+=(const ChunkCacheStats& ccs)
 	missing += ccs.missing;
 	reqmissing += ccs.reqmissing;
 	corrupt += ccs.corrupt;
+	conflict += ccs.conflict;
+	capacity += ccs.capacity;
+	batched += ccs.batched;
 	return *this;
 }
 
-ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
+ChunkCache::ChunkCache(int64_t budget, int threads)
+	: clock(0), filled(0)
 {
-	int state = chunktable.getDiskState(ci);
-	if (state == ChunkSet::CHUNK_UNKNOWN)
-		stats.misses++;
+	int64_t size = (budget > 0) ? budget / (int64_t)CHUNKDATAESTIMATE : CACHESIZE;
+	ways = max(CACHEWAYS, threads * CACHEPINS + 1);
+	setbits = 0;
+	while ((int64_t)ways << (setbits + 1) <= size)
+		setbits++;
+	int numsets = 1 << setbits;
+	sets = new Set[numsets];
+	entries.resize(numsets * ways);
+	for (int i = 0; i < numsets; i++)
+		for (int j = 0; j < ways; j++)
+			sets[i].entries.push_back(&entries[i * ways + j]);
+}
+
+int ChunkCache::acquire(const PosChunkIdx& ci, ChunkCacheEntry*& entry, bool seen, ChunkCacheStats& stats)
+{
+	Set& set = sets[getSetNum(ci)];
+	int64_t key = getKey(ci);
+	int64_t now = __sync_add_and_fetch(&clock, 1);
+	mutexLocker ml(set.mutex);
+	for (;;)
+	{
+		map<int64_t, int>::const_iterator fit = set.failed.find(key);
+		if (fit != set.failed.end())
+		{
+			entry = NULL;
+			return fit->second;
+		}
+
+		ChunkCacheEntry *found = NULL;
+		for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+			if ((*it)->ci == ci)
+			{
+				found = *it;
+				break;
+			}
+		if (found == NULL)
+			break;
+		// if someone else is reading this chunk right now, wait for them and then look again (the
+		//  read might have failed, or the entry might even have been evicted already)
+		if (!found->ready)
+		{
+			pthread_cond_wait(&set.loaded, &set.mutex);
+			continue;
+		}
+		entry = found;
+		entry->refs++;
+		entry->lastuse = now;
+		return ChunkSet::CHUNK_CACHED;
+	}
+
+	// not here; if we've had it before, it must have been evicted, and we know which kind of eviction
+	//  that was
+	if (seen)
+	{
+		map<int64_t, int64_t>::iterator eit = set.evicted.find(key);
+		if (eit != set.evicted.end())
+			stats.conflict++;
+		else
+			stats.capacity++;
+	}
+
+	entry = claimEntry(set, ci, now);
+	entry->ready = false;
+	entry->refs = 1;
+	return ChunkSet::CHUNK_UNKNOWN;
+}
+
+bool ChunkCache::wouldKeep(const Set& set, const ChunkCacheEntry *victim, int64_t now)
+{
+	// if the cache still has an empty entry, or fewer lookups have happened since the victim's last use
+	//  than there are entries (so fewer other chunks can have been used since), it's certainly a conflict
+	if (__sync_add_and_fetch(&filled, 0) < (int64_t)entries.size() || now - victim->lastuse < (int64_t)entries.size())
+		return true;
+	// otherwise, look for an older entry in a few other sets; we can't wait for their locks while holding
+	//  our own, so sets that are busy are just skipped
+	int numsets = 1 << setbits;
+	for (int i = 0; i < CACHESAMPLESETS && i < numsets - 1; i++)
+	{
+		Set& other = sets[((uint64_t)(now + i) * 0x9e3779b97f4a7c15ULL) >> (64 - setbits)];
+		if (&other == &set || 0 != pthread_mutex_trylock(&other.mutex))
+			continue;
+		bool older = false;
+		for (vector<ChunkCacheEntry*>::const_iterator it = other.entries.begin(); it != other.entries.end() && !older; it++)
+			older = (*it)->refs == 0 && (*it)->lastuse < victim->lastuse;
+		pthread_mutex_unlock(&other.mutex);
+		if (older)
+			return true;
+	}
+	return false;
+}
+
+ChunkCacheEntry* ChunkCache::claimEntry(Set& set, const PosChunkIdx& ci, int64_t now)
+{
+	// claim the least recently used entry that nobody is holding
+	// (there must be one, since the set has more entries than all the readers have pins)
+	ChunkCacheEntry *victim = NULL;
+	for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+		if ((*it)->refs == 0 && (victim == NULL || (*it)->lastuse < victim->lastuse))
+			victim = *it;
+	if (victim == NULL)
+	{
+		cerr << "grievous chunk cache failure!  no free entries in set " << getSetNum(ci) << endl;
+		exit(-1);
+	}
+	if (!victim->ci.valid())
+		__sync_add_and_fetch(&filled, 1);
 	else
-		stats.hits++;
+	{
+		if (wouldKeep(set, victim, now))
+			set.evicted[getKey(victim->ci)] = victim->lastuse;
+		// don't let the list grow without bound; forget the older half (those chunks will be counted as
+		//  capacity misses if they come back)
+		if (set.evicted.size() >= CACHEEVICTEDMAX)
+		{
+			vector<int64_t> uses;
+			for (map<int64_t, int64_t>::const_iterator it = set.evicted.begin(); it != set.evicted.end(); it++)
+				uses.push_back(it->second);
+			nth_element(uses.begin(), uses.begin() + uses.size() / 2, uses.end());
+			int64_t cutoff = uses[uses.size() / 2];
+			for (map<int64_t, int64_t>::iterator it = set.evicted.begin(); it != set.evicted.end();)
+				if (it->second < cutoff)
+					set.evicted.erase(it++);
+				else
+					it++;
+		}
+	}
+	set.evicted.erase(getKey(ci));
+	victim->ci = ci;
+	victim->lastuse = now;
+	return victim;
+}
 
-	// if the chunk is in the cache, return it
+void ChunkCache::finishLoad(ChunkCacheEntry *entry, int state)
+{
+	Set& set = sets[getSetNum(entry->ci)];
+	mutexLocker ml(set.mutex);
 	if (state == ChunkSet::CHUNK_CACHED)
+		entry->ready = true;
+	else
+	{
+		set.failed[getKey(entry->ci)] = state;
+		__sync_sub_and_fetch(&filled, 1);
+		entry->ci = PosChunkIdx(-1,-1);
+		entry->refs = 0;
+		entry->lastuse = 0;
+	}
+	pthread_cond_broadcast(&set.loaded);
+}
+
+void ChunkCache::release(ChunkCacheEntry *entry)
+{
+	Set& set = sets[getSetNum(entry->ci)];
+	mutexLocker ml(set.mutex);
+	entry->refs--;
+}
+
+bool ChunkCache::publish(const PosChunkIdx& ci, ChunkData& data)
+{
+	Set& set = sets[getSetNum(ci)];
+	int64_t now = __sync_add_and_fetch(&clock, 1);
+	mutexLocker ml(set.mutex);
+	if (set.failed.count(getKey(ci)) > 0)
+		return false;
+	for (vector<ChunkCacheEntry*>::const_iterator it = set.entries.begin(); it != set.entries.end(); it++)
+		if ((*it)->ci == ci)
+			return false;
+	ChunkCacheEntry *entry = claimEntry(set, ci, now);
+	entry->data.swap(data);
+	entry->ready = true;
+	entry->refs = 0;
+	return true;
+}
+
+
+
+ChunkCacheReader::~ChunkCacheReader()
+{
+	for (int i = 0; i < CACHEPINS; i++)
+		if (pins[i] != NULL)
+			cache.release(pins[i]);
+}
+
+ChunkData* ChunkCacheReader::getData(const PosChunkIdx& ci)
+{
+	// if we're already holding the chunk, just return it
+	// (entries can't change while pinned, so no locking is needed)
+	int lru = 0;
+	for (int i = 0; i < CACHEPINS; i++)
 	{
-		int e = getEntryNum(ci);
-		ChunkCacheEntry& entry = entries[e];
-		if (entry.ci != ci)
+		if (pins[i] != NULL && pins[i]->ci == ci)
 		{
-			cerr << "grievous chunk cache failure!" << endl;
-			cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-			exit(-1);
+			stats.hits++;
+			pinuse[i] = ++tick;
+			return &pins[i]->data;
 		}
-		return &entry.data;
+		if (pinuse[i] < pinuse[lru])
+			lru = i;
 	}
 
 	// if we've already tried and failed to read the chunk, don't try again
+	int state = chunktable.getDiskState(ci);
 	if (state == ChunkSet::CHUNK_MISSING || state == ChunkSet::CHUNK_CORRUPTED)
-		return &blankdata;
+	{
+		stats.hits++;
+		return &cache.blankdata;
+	}
 
 	// if this is a full render and the chunk is not required, we already know it doesn't exist
 	bool req = chunktable.isRequired(ci);
 	if (fullrender && !req)
 	{
+		stats.misses++;
 		stats.skipped++;
 		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return &blankdata;
+		return &cache.blankdata;
+	}
+
+	// give up our least recently used pin (before taking another, so we never hold more than CACHEPINS)
+	if (pins[lru] != NULL)
+		cache.release(pins[lru]);
+	pins[lru] = NULL;
+	pinuse[lru] = 0;
+
+	// see whether the chunk is in the shared cache, or whether some other thread has failed to read it
+	ChunkCacheEntry *entry;
+	state = cache.acquire(ci, entry, state == ChunkSet::CHUNK_CACHED, stats);
+	if (state == ChunkSet::CHUNK_CACHED)
+	{
+		stats.hits++;
+		pins[lru] = entry;
+		pinuse[lru] = ++tick;
+		return &entry->data;
+	}
+	if (state == ChunkSet::CHUNK_MISSING || state == ChunkSet::CHUNK_CORRUPTED)
+	{
+		stats.hits++;
+		chunktable.setDiskState(ci, state);
+		return &cache.blankdata;
 	}
 
-	// okay, we actually have to read the chunk from disk
+	// okay, we actually have to read the chunk from disk, into the entry we've claimed
+	stats.misses++;
 	if (regionformat)
-		readFromRegionCache(ci);
+		state = readFromRegionCache(ci, entry->data);
 	else
-		readChunkFile(ci);
+		state = readChunkFile(ci, entry->data);
+	cache.finishLoad(entry, state);
+	// if that meant reading a new region file, decode the rest of the chunks we'll want from it now, too
+	if (decoder != NULL && regioncache.fresh != NULL)
+		decodeRegion(ci);
 
 	// check whether the read succeeded; return the data if so
-	state = chunktable.getDiskState(ci);
 	if (state == ChunkSet::CHUNK_CORRUPTED)
 	{
 		stats.corrupt++;
-		return &blankdata;
+		chunktable.setDiskState(ci, state);
+		return &cache.blankdata;
 	}
 	if (state == ChunkSet::CHUNK_MISSING)
 	{
@@ -383,75 +859,220 @@ ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 			stats.reqmissing++;
 		else
 			stats.missing++;
-		return &blankdata;
-	}
-	int e = getEntryNum(ci);
-	if (state != ChunkSet::CHUNK_CACHED || entries[e].ci != ci)
-	{
-		cerr << "grievous chunk cache failure!" << endl;
-		cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-		exit(-1);
+		chunktable.setDiskState(ci, state);
+		return &cache.blankdata;
 	}
 	stats.read++;
-	return &entries[e].data;
+	chunktable.setDiskState(ci, ChunkSet::CHUNK_CACHED);
+	pins[lru] = entry;
+	pinuse[lru] = ++tick;
+	return &entry->data;
 }
 
-void ChunkCache::readChunkFile(const PosChunkIdx& ci)
+int ChunkCacheReader::readChunkFile(const PosChunkIdx& ci, ChunkData& data)
 {
 	// read the gzip file from disk, if it's there
 	string filename = inputpath + "/" + ci.toChunkIdx().toFilePath();
 	int result = readGzFile(filename, readbuf);
 	if (result == -1)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return;
-	}
+		return ChunkSet::CHUNK_MISSING;
 	if (result == -2)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
-		return;
-	}
+		return ChunkSet::CHUNK_CORRUPTED;
 
 	// gzip read was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, false);
+	return parseReadBuf(data, false);
 }
 
-void ChunkCache::readFromRegionCache(const PosChunkIdx& ci)
+int ChunkCacheReader::readFromRegionCache(const PosChunkIdx& ci, ChunkData& data)
 {
 	// try to decompress the chunk data
 	bool anvil;
 	int result = regioncache.getDecompressedChunk(ci, readbuf, anvil);
 	if (result == -1)
-	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
+		return ChunkSet::CHUNK_MISSING;
+	if (result == -2)
+		return ChunkSet::CHUNK_CORRUPTED;
+	
+	// decompression was successful; extract the data we need from the chunk
+	return parseReadBuf(data, anvil);
+}
+
+int ChunkCacheReader::parseReadBuf(ChunkData& data, bool anvil)
+{
+	bool result = anvil ? data.loadFromAnvilFile(readbuf, sections) : data.loadFromOldFile(readbuf, sections);
+	return result ? ChunkSet::CHUNK_CACHED : ChunkSet::CHUNK_CORRUPTED;
+}
+
+// for picking the chunks nearest the one that started a batch
+struct closerChunk
+{
+	ChunkIdx center;
+	closerChunk(const ChunkIdx& ci) : center(ci) {}
+	int64_t dist(const ChunkIdx& ci) const {return abs(ci.x - center.x) + abs(ci.z - center.z);}
+	bool operator()(const ChunkIdx& ci1, const ChunkIdx& ci2) const {return dist(ci1) < dist(ci2);}
+};
+
+void ChunkCacheReader::decodeRegion(const PosChunkIdx& ci)
+{
+	RegionFileReader& regionfile = regioncache.fresh->regionfile;
+	regioncache.fresh = NULL;
+	// if the file wasn't mapped, we only wanted a few of its chunks anyway
+	if (regionfile.mapping == NULL)
 		return;
+
+	// find the required chunks that haven't been read yet; if there are more than the cache can comfortably
+	//  hold, take the ones nearest this one, which will probably be needed first
+	ChunkIdx center = ci.toChunkIdx();
+	batchchunks.clear();
+	for (RegionChunkIterator it(center.getRegionIdx()); !it.end; it.advance())
+	{
+		PosChunkIdx pci(it.current);
+		if (it.current != center && regionfile.containsChunk(it.current) && chunktable.isRequired(pci) &&
+		    chunktable.getDiskState(pci) == ChunkSet::CHUNK_UNKNOWN)
+			batchchunks.push_back(it.current);
 	}
-	if (result == -2)
+	size_t maxbatch = min((size_t)DECODEBATCHMAX, cache.entries.size() / 4);
+	if (batchchunks.size() > maxbatch)
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
+		nth_element(batchchunks.begin(), batchchunks.begin() + maxbatch, batchchunks.end(), closerChunk(center));
+		batchchunks.erase(batchchunks.begin() + maxbatch, batchchunks.end());
+	}
+	if (batchchunks.empty())
 		return;
+
+	decoder->decode(regionfile, batchchunks, batchdata, batchstates, sections, regioncache.inflater, readbuf,
+	                regioncache.sectorbuf);
+
+	for (size_t i = 0; i < batchchunks.size(); i++)
+	{
+		PosChunkIdx pci(batchchunks[i]);
+		if (batchstates[i] == ChunkSet::CHUNK_CACHED)
+		{
+			if (cache.publish(pci, batchdata[i]))
+			{
+				stats.read++;
+				stats.batched++;
+				chunktable.setDiskState(pci, ChunkSet::CHUNK_CACHED);
+			}
+		}
+		else
+		{
+			if (batchstates[i] == ChunkSet::CHUNK_CORRUPTED)
+				stats.corrupt++;
+			chunktable.setDiskState(pci, batchstates[i]);
+		}
 	}
-	
-	// decompression was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, anvil);
 }
 
-void ChunkCache::parseReadBuf(const PosChunkIdx& ci, bool anvil)
+
+//---------------------------------------------------------------------------------------------------
+
+
+// check the SIMD versions of extractBlockIDs against the plain one, and time them all, with and without
+//  Add arrays
+void benchExtractBlockIDs()
+{
+	vector<uint8_t> ids(4096), add(2048);
+	for (int i = 0; i < 4096; i++)
+		ids[i] = rand() % 256;
+	for (int i = 0; i < 2048; i++)
+		add[i] = rand() % 256;
+	vector<uint16_t> expected(4096), result(4096);
+
+	vector<pair<string, ExtractBlockIDsFunc> > funcs;
+	funcs.push_back(make_pair(string("plain"), extractBlockIDsPlain));
+#ifdef HAVE_SIMD_EXTRACT
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		funcs.push_back(make_pair(string("SSE2"), extractBlockIDsSSE2));
+	if (__builtin_cpu_supports("avx2"))
+		funcs.push_back(make_pair(string("AVX2"), extractBlockIDsAVX2));
+#endif
+
+	const int reps = 200000;
+	for (int withadd = 0; withadd < 2; withadd++)
+	{
+		const uint8_t *addptr = withadd ? &add[0] : NULL;
+		for (vector<pair<string, ExtractBlockIDsFunc> >::const_iterator it = funcs.begin(); it != funcs.end(); it++)
+		{
+			extractBlockIDsPlain(&ids[0], addptr, &expected[0]);
+			it->second(&ids[0], addptr, &result[0]);
+			if (result != expected)
+				cout << it->first << " doesn't match plain version!" << endl;
+			int64_t start = getMicroseconds();
+			for (int i = 0; i < reps; i++)
+			{
+				// (change the input a little each time, so the compiler can't hoist anything)
+				ids[i % 4096]++;
+				it->second(&ids[0], addptr, &result[0]);
+			}
+			double ns = (double)(getMicroseconds() - start) * 1000.0 / reps;
+			cout << (withadd ? "with Add:    " : "without Add: ") << it->first << " " << ns << " ns/section" << endl;
+		}
+	}
+}
+
+// look up every block of a chunk the way renderTile and checkSpecial do: the offset of the block itself,
+//  plus the IDs and data of its four horizontal neighbours (within the chunk)
+template <class Section> int64_t lookupBlocks(const ChunkDataT<Section>& cd, const vector<int>& offsets)
+{
+	int64_t sum = 0;
+	for (int64_t y = 0; y < 256; y++)
+		for (int64_t z = 1; z < 15; z++)
+			for (int64_t x = 1; x < 15; x++)
+			{
+				uint16_t block = cd.block(BlockIdx(x, z, y));
+				if ((block >> 4) == 0)
+					continue;
+				sum += offsets[block];
+				sum += cd.id(BlockIdx(x - 1, z, y)) + cd.data(BlockIdx(x - 1, z, y));
+				sum += cd.id(BlockIdx(x + 1, z, y)) + cd.data(BlockIdx(x + 1, z, y));
+				sum += cd.id(BlockIdx(x, z - 1, y)) + cd.data(BlockIdx(x, z - 1, y));
+				sum += cd.id(BlockIdx(x, z + 1, y)) + cd.data(BlockIdx(x, z + 1, y));
+			}
+	return sum;
+}
+
+template <class Section> void timeBlockLayout(const string& name, const vector<uint8_t>& ids, const vector<uint8_t>& data,
+                                              const vector<int>& offsets, int reps)
 {
-	// evict current tenant of chunk's cache slot
-	int e = getEntryNum(ci);
-	if (entries[e].ci.valid())
-		chunktable.setDiskState(entries[e].ci, ChunkSet::CHUNK_UNKNOWN);
-	entries[e].ci = PosChunkIdx(-1,-1);
-	// ...and put this chunk's data into the slot, assuming the data can actually be parsed
-	bool result = anvil ? entries[e].data.loadFromAnvilFile(readbuf) : entries[e].data.loadFromOldFile(readbuf);
-	if (result)
+	// fill the lower 8 sections from the same random arrays, leaving the rest as air
+	ChunkDataT<Section> cd;
+	cd.storage.resize(8);
+	for (int i = 0; i < 8; i++)
 	{
-		entries[e].ci = ci;
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CACHED);
+		cd.storage[i].extract(&ids[i * 4096], NULL, &data[i * 2048]);
+		cd.sections[i] = &cd.storage[i];
 	}
-	else
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
+	cd.computeHeights();
+
+	int64_t sum = 0;
+	int64_t start = getMicroseconds();
+	for (int i = 0; i < reps; i++)
+	{
+		// (change the chunk a little each time, so the compiler can't hoist anything)
+		cd.storage[0].setData(i % 4096, i % 16);
+		sum += lookupBlocks(cd, offsets);
+	}
+	double us = (double)(getMicroseconds() - start) / reps;
+	cout << name << us << " us/chunk   (checksum " << sum << ")" << endl;
+}
+
+// compare the split and fused ChunkSection layouts on renderer-style lookups (the checksums should match)
+void benchBlockLayouts()
+{
+	// mostly air and a handful of common blocks, like real terrain
+	vector<uint8_t> ids(8 * 4096), data(8 * 2048);
+	const uint8_t common[8] = {0, 0, 0, 1, 2, 3, 9, 17};
+	for (size_t i = 0; i < ids.size(); i++)
+		ids[i] = (rand() % 16 == 0) ? rand() % 256 : common[rand() % 8];
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (rand() % 4 == 0) ? rand() % 256 : 0;
+	vector<int> offsets(4096 * 16);
+	for (size_t i = 0; i < offsets.size(); i++)
+		offsets[i] = rand() % 1024;
+
+	const int reps = 2000;
+	timeBlockLayout<SplitBlockSection>("split: ", ids, data, offsets, reps);
+	timeBlockLayout<FusedBlockSection>("fused: ", ids, data, offsets, reps);
 }
@@ -21,8 +21,11 @@
 #include <string.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "map.h"
 #include "tables.h"
@@ -47,30 +50,133 @@ struct BlockOffset
 	}
 };
 
-struct ChunkData
+// widen a section's 8-bit block IDs, plus the 4-bit Add values if blockAdd isn't NULL, into 12-bit IDs
+// ...uses AVX2 or SSE2 if the CPU has them (chosen at runtime), otherwise a plain loop
+void extractBlockIDs(const uint8_t *blockIDs, const uint8_t *blockAdd, uint16_t *dest);
+
+// block data for a 16x16x16 section of a chunk, in one of two layouts (ChunkData picks one at compile time)
+// ...both are indexed by (Y * 16 + Z) * 16 + X, and have the same accessors; block() gives the ID and
+//  data together as ID << 4 | data, which is also the index into BlockImages::blockOffsets
+
+// IDs and data kept apart, as in the chunk files
+struct SplitBlockSection
 {
-	uint16_t blockIDs[65536];  // 8 bits in mcr format, 12 in anvil - use 16 for fast access, transform on load.
-	uint8_t blockData[32768];  // 4 bits per block (only half of this space used for old-style chunks)
-	bool anvil;  // whether this data came from an Anvil chunk or an old-style one
+	uint16_t blockIDs[4096];  // 8 bits in mcr format, 12 in anvil - use 16 for fast access, transform on load.
+	uint8_t blockData[2048];  // 4 bits per block
 
-	// these guys assume that the BlockIdx actually points to this chunk
-	//  (so they only look at the lower bits)
-	uint16_t id(const BlockOffset& bo) const
+	void clear() {std::fill(blockIDs, blockIDs + 4096, 0); std::fill(blockData, blockData + 2048, 0);}
+	bool empty() const;
+
+	uint16_t id(int i) const {return blockIDs[i];}
+	uint8_t data(int i) const {return (i % 2 == 0) ? (blockData[i/2] & 0xf) : ((blockData[i/2] & 0xf0) >> 4);}
+	uint16_t block(int i) const {return (blockIDs[i] << 4) | data(i);}
+
+	void setID(int i, uint16_t id) {blockIDs[i] = id;}
+	void setData(int i, uint8_t data)
 	{
-		return blockIDs[(bo.y * 16 + bo.z) * 16 + bo.x];
+		uint8_t& b = blockData[i/2];
+		b = (i % 2 == 0) ? ((b & 0xf0) | data) : ((b & 0xf) | (data << 4));
 	}
-	uint8_t data(const BlockOffset& bo) const
+	// fill in from the arrays of an Anvil section (blockAdd may be NULL)
+	void extract(const uint8_t *ids, const uint8_t *add, const uint8_t *data);
+};
+
+// each ID stored together with its data in a single 16-bit value, so one load gets both
+struct FusedBlockSection
+{
+	uint16_t blocks[4096];  // ID << 4 | data
+
+	void clear() {std::fill(blocks, blocks + 4096, 0);}
+	bool empty() const;
+
+	uint16_t id(int i) const {return blocks[i] >> 4;}
+	uint8_t data(int i) const {return blocks[i] & 0xf;}
+	uint16_t block(int i) const {return blocks[i];}
+
+	void setID(int i, uint16_t id) {blocks[i] = (id << 4) | (blocks[i] & 0xf);}
+	void setData(int i, uint8_t data) {blocks[i] = (blocks[i] & 0xfff0) | data;}
+	void extract(const uint8_t *ids, const uint8_t *add, const uint8_t *data);
+};
+
+// only the sections actually present in the chunk are stored; the rest point at a shared section full of
+//  air, so lookups don't have to check for them
+// ...Section is SplitBlockSection or FusedBlockSection; the rest of the program uses the ChunkData typedef
+//  below, but both versions are compiled (for benchBlockLayouts)
+template <class Section> struct ChunkDataT
+{
+	Section *sections[16];  // indexed by Y / 16; either into storage, or &emptySection
+	std::vector<Section> storage;  // keeps its capacity from one load to the next
+	uint16_t sectionMask;  // bit N is set if sections[N] is stored (i.e. isn't &emptySection)
+	uint16_t heights[256];  // for each column (Z * 16 + X), one more than the Y of its highest non-air block
+	bool anvil;  // whether this data came from an Anvil chunk or an old-style one
+
+	static Section emptySection;
+
+	ChunkDataT() : anvil(true) {clear();}
+	ChunkDataT(const ChunkDataT& cd) {*this = cd;}
+	ChunkDataT& operator=(const ChunkDataT& cd);
+
+	// trade contents with another ChunkData (cheaply, unlike copying)
+	void swap(ChunkDataT& cd);
+
+	// make the chunk all air
+	void clear() {storage.clear(); std::fill(sections, sections + 16, &emptySection); sectionMask = 0; std::fill(heights, heights + 256, 0);}
+	// fill in heights from the sections
+	void computeHeights();
+
+	bool emptySectionAt(int64_t y) const {return !(sectionMask & (1 << (y >> 4)));}
+
+	// how many steps down a pseudocolumn (+X, -Z, -Y) we can take from a block without reaching anything
+	//  but air; stops at the edge of the chunk, so may be less than the true amount
+	// ...empty sections are crossed in one go, rather than a block at a time
+	int airSteps(const BlockOffset& bo) const
 	{
-		int i = (bo.y * 16 + bo.z) * 16 + bo.x;
-		if ((i % 2) == 0)
-			return blockData[i/2] & 0xf;
-		return (blockData[i/2] & 0xf0) >> 4;
+		int64_t x = bo.x, z = bo.z, y = bo.y;
+		while (x < 16 && z >= 0 && y >= 0)
+		{
+			int64_t steps;
+			if (emptySectionAt(y))
+				steps = std::min((y & 0xf) + 1, std::min(16 - x, z + 1));
+			else if (y >= heights[z * 16 + x])
+				steps = 1;
+			else
+				break;
+			x += steps;
+			z -= steps;
+			y -= steps;
+		}
+		return x - bo.x;
 	}
 
-	bool loadFromOldFile(const std::vector<uint8_t>& filebuf);
-	bool loadFromAnvilFile(const std::vector<uint8_t>& filebuf);
+	// these guys assume that the BlockIdx actually points to this chunk
+	//  (so they only look at the lower bits)
+	static int sectionIndex(const BlockOffset& bo) {return ((bo.y & 0xf) * 16 + bo.z) * 16 + bo.x;}
+	uint16_t id(const BlockOffset& bo) const {return sections[bo.y >> 4]->id(sectionIndex(bo));}
+	uint8_t data(const BlockOffset& bo) const {return sections[bo.y >> 4]->data(sectionIndex(bo));}
+	// ID << 4 | data
+	uint16_t block(const BlockOffset& bo) const {return sections[bo.y >> 4]->block(sectionIndex(bo));}
+
+	// sections whose bits aren't set in wanted are left empty (see sectionsForYRange)
+	bool loadFromOldFile(const std::vector<uint8_t>& filebuf, uint16_t wanted = 0xffff);
+	bool loadFromAnvilFile(const std::vector<uint8_t>& filebuf, uint16_t wanted = 0xffff);
 };
 
+// build with FUSED_BLOCKS defined (make blocks=fused) to use the fused layout
+#ifdef FUSED_BLOCKS
+typedef FusedBlockSection ChunkSection;
+#else
+typedef SplitBlockSection ChunkSection;
+#endif
+typedef ChunkDataT<ChunkSection> ChunkData;
+
+// the sections a render can look at, given the Y range of its MapParams: those with any blocks in
+//  [minY - 1, maxY + 1] (one beyond the range for the neighbours checkSpecial examines); the rest needn't
+//  be decoded at all
+uint16_t sectionsForYRange(const MapParams& mp);
+
+// rough memory used by a typical cached chunk (a few of its sections present), for sizing the ChunkCache
+#define CHUNKDATAESTIMATE (sizeof(ChunkData) + 6 * sizeof(ChunkSection))
+
 
 
 struct ChunkCacheStats
@@ -90,7 +196,14 @@ struct ChunkCacheStats
 	//  corrupt: region file itself is okay, but chunk data within it is corrupt
 	//  skipped/reqmissing: unused
 
-	ChunkCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	// misses on chunks that had been read before, but were evicted since (the rest are first reads):
+	int64_t conflict;  // would still have been cached if any entry could hold any chunk (a lower bound; see wouldKeep)
+	int64_t capacity;  // too many other chunks used since
+	// chunks decoded along with the rest of their region (see ChunkDecoder), rather than when they were
+	//  looked up (these are included in read)
+	int64_t batched;
+
+	ChunkCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0), conflict(0), capacity(0), batched(0) {}
 
 	ChunkCacheStats& operator+=(const ChunkCacheStats& ccs);
 };
@@ -99,23 +212,91 @@ struct ChunkCacheEntry
 {
 	PosChunkIdx ci;  // or [-1,-1] if this entry is empty
 	ChunkData data;
+	int refs;  // number of ChunkCacheReaders holding this entry (it can't be evicted while > 0)
+	bool ready;  // false while the data is still being read by the thread that claimed the entry
+	int64_t lastuse;  // cache clock at the most recent lookup, for choosing eviction victims
 
-	ChunkCacheEntry() : ci(-1,-1) {}
+	ChunkCacheEntry() : ci(-1,-1), refs(0), ready(false), lastuse(0) {}
 };
 
-#define CACHEBITSX 5
-#define CACHEBITSZ 5
-#define CACHEXSIZE (1 << CACHEBITSX)
-#define CACHEZSIZE (1 << CACHEBITSZ)
-#define CACHESIZE (CACHEXSIZE * CACHEZSIZE)
-#define CACHEXMASK (CACHEXSIZE - 1)
-#define CACHEZMASK (CACHEZSIZE - 1)
+#define CACHESIZE 1024  // default number of entries, shared by all threads
+#define CACHEWAYS 16  // default number of entries per set
+#define CACHEPINS 4  // entries held by each ChunkCacheReader
+#define CACHEEVICTEDMAX 1024  // evicted chunks remembered by each set for the miss stats
+#define CACHESAMPLESETS 4  // other sets checked on each eviction, for the miss stats
 
+// chunk data storage shared by all the render threads: a set-associative cache, where each chunk can only
+//  go in one set (chosen by hashing its coords), and each set is LRU and has its own lock
+// ...the actual reading of chunks is done by the ChunkCacheReaders, which each belong to a single thread
 struct ChunkCache : private nocopy
 {
-	ChunkCacheEntry entries[CACHESIZE];
+	struct Set
+	{
+		pthread_mutex_t mutex;
+		pthread_cond_t loaded;  // signalled when a thread finishes (or fails) reading a chunk into an entry
+		std::vector<ChunkCacheEntry*> entries;
+		std::map<int64_t, int> failed;  // chunks that turned out to be missing or corrupt, with their disk state
+		std::map<int64_t, int64_t> evicted;  // chunks evicted that a fully associative cache would have kept
+		                                      //  (see claimEntry), with their last use (for the miss stats)
+
+		Set() {pthread_mutex_init(&mutex, NULL); pthread_cond_init(&loaded, NULL);}
+		~Set() {pthread_mutex_destroy(&mutex); pthread_cond_destroy(&loaded);}
+	};
+
+	Set *sets;
+	int setbits;  // there are 2^setbits sets
+	int ways;  // entries per set
+	int64_t clock;  // total lookups so far (atomic)
+	int64_t filled;  // entries holding a chunk (atomic)
+	std::vector<ChunkCacheEntry> entries;
 	ChunkData blankdata;  // for use with missing chunks
 
+	// budget is the total bytes for entries (0 for the default CACHESIZE entries), assuming each chunk takes
+	//  about CHUNKDATAESTIMATE; the sets get at least
+	//  CACHEWAYS entries each, and also enough for every thread to hold all its pins in the same set at once
+	ChunkCache(int64_t budget, int threads);
+	~ChunkCache() {delete[] sets;}
+
+	int getSetNum(const PosChunkIdx& ci) const {return (setbits == 0) ? 0 : (int)(((uint64_t)getKey(ci) * 0x9e3779b97f4a7c15ULL) >> (64 - setbits));}
+	static int64_t getKey(const PosChunkIdx& ci) {return ci.x * CTTOTALSIZE + ci.z;}
+
+	// look up a chunk and add a reference to its entry, waiting if another thread is reading it; return
+	//  values:
+	//   -CHUNK_CACHED: entry holds the data
+	//   -CHUNK_UNKNOWN: chunk was not present, so entry has been claimed (with ready == false) and must be
+	//     filled in by the caller, who then calls finishLoad
+	//   -CHUNK_MISSING/CHUNK_CORRUPTED: some thread already failed to read the chunk (entry is NULL)
+	// ...if the chunk isn't present but has been read before (seen == true), the miss is counted as a
+	//  conflict or capacity miss in stats
+	int acquire(const PosChunkIdx& ci, ChunkCacheEntry*& entry, bool seen, ChunkCacheStats& stats);
+	// publish the data read into a claimed entry, or give the entry up if the read failed (state is the
+	//  disk state of the chunk)
+	void finishLoad(ChunkCacheEntry *entry, int state);
+	void release(ChunkCacheEntry *entry);
+	// put a chunk that was read ahead of time into the cache (swapping the data into an entry), unless it's
+	//  already there or some thread is reading it; returns whether it was used
+	bool publish(const PosChunkIdx& ci, ChunkData& data);
+
+	// pick an entry for a chunk, evicting whatever was in it (the set must be locked)
+	ChunkCacheEntry* claimEntry(Set& set, const PosChunkIdx& ci, int64_t now);
+	// guess whether a fully associative LRU cache would have kept an entry that its set is about to
+	//  evict, so a later miss on it can be counted as a conflict miss; this checks only a sample of the
+	//  other sets, so it can miss some (the set must be locked)
+	bool wouldKeep(const Set& set, const ChunkCacheEntry *victim, int64_t now);
+};
+
+// per-thread view of the shared ChunkCache: reads chunks from disk (through the thread's own RegionCache)
+//  when they aren't cached yet, and holds a reference to the last few entries it has returned, so their data
+//  stays valid without the render code having to release anything
+struct ChunkDecoder;
+
+struct ChunkCacheReader : private nocopy
+{
+	ChunkCache& cache;
+	ChunkCacheEntry *pins[CACHEPINS];  // NULL for unused
+	int64_t pinuse[CACHEPINS];  // last lookup of each pin, for replacing the least recent
+	int64_t tick;
+
 	ChunkTable& chunktable;
 	RegionTable& regiontable;
 	ChunkCacheStats& stats;
@@ -124,26 +305,40 @@ struct ChunkCache : private nocopy
 	bool fullrender;
 	bool regionformat;
 	std::vector<uint8_t> readbuf;  // buffer for decompressing into when reading
-	ChunkCache(ChunkTable& ctable, RegionTable& rtable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), stats(st), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform)
+	// if not NULL, whenever we read a new region, the required chunks in it are decoded all together, and put
+	//  into the cache ahead of time
+	ChunkDecoder *decoder;
+	std::vector<ChunkIdx> batchchunks;  // scratch space for the batches
+	std::vector<ChunkData> batchdata;
+	std::vector<int> batchstates;
+	uint16_t sections;  // which sections of each chunk to decode (see sectionsForYRange)
+	ChunkCacheReader(ChunkCache& ccache, ChunkTable& ctable, RegionTable& rtable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st)
+		: cache(ccache), tick(0), chunktable(ctable), regiontable(rtable), stats(st), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform), decoder(NULL), sections(0xffff)
 	{
-		memset(blankdata.blockIDs, 0, 65536 * 2);
-		memset(blankdata.blockData, 0, 32768);
-		blankdata.anvil = true;
+		std::fill(pins, pins + CACHEPINS, (ChunkCacheEntry*)NULL);
+		std::fill(pinuse, pinuse + CACHEPINS, 0);
 		readbuf.reserve(262144);
 	}
+	~ChunkCacheReader();
 
 	// look up a chunk and return a pointer to its data
 	// ...for missing/corrupt chunks, return a pointer to some blank data
+	// ...the pointer remains valid until at least CACHEPINS - 1 other chunks have been looked up
 	ChunkData* getData(const PosChunkIdx& ci);
 
-	static int getEntryNum(const PosChunkIdx& ci) {return (ci.x & CACHEXMASK) * CACHEZSIZE + (ci.z & CACHEZMASK);}
-
-	void readChunkFile(const PosChunkIdx& ci);
-	void readFromRegionCache(const PosChunkIdx& ci);
-	void parseReadBuf(const PosChunkIdx& ci, bool anvil);
+	// read a chunk into a claimed cache entry; return the resulting disk state
+	int readChunkFile(const PosChunkIdx& ci, ChunkData& data);
+	int readFromRegionCache(const PosChunkIdx& ci, ChunkData& data);
+	int parseReadBuf(ChunkData& data, bool anvil);
+	// decode a batch of chunks from the region that was just read (for the chunk ci), and publish them
+	void decodeRegion(const PosChunkIdx& ci);
 };
 
 
 
+
+void benchExtractBlockIDs();
+void benchBlockLayouts();
+
+
 #endif // CHUNK_H
\ No newline at end of file
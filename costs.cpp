@@ -0,0 +1,145 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "costs.h"
+#include "utils.h"
+
+using namespace std;
+
+
+#define COSTFILEMAGIC "pigmapcost1"
+
+struct fcloser
+{
+	FILE *f;
+	fcloser(FILE *ff) : f(ff) {}
+	~fcloser() {fclose(f);}
+};
+
+bool TileCostTable::get(const TileIdx& ti, uint32_t& cost) const
+{
+	map<pair<int64_t, int64_t>, uint32_t>::const_iterator it = costs.find(make_pair(ti.x, ti.y));
+	if (it == costs.end())
+		return false;
+	cost = it->second;
+	return true;
+}
+
+// file format: magic string (with its terminating NUL), then B, T, and the number of entries as int32s,
+//  then the entries; all in native byte order, since the file is only a hint anyway
+bool TileCostTable::readFile(const string& outputpath, const MapParams& mp)
+{
+	costs.clear();
+	string filename = outputpath + "/pigmap.costs";
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return false;
+	fcloser fc(f);
+
+	char magic[sizeof(COSTFILEMAGIC)];
+	int32_t header[3];
+	if (1 != fread(magic, sizeof(magic), 1, f) || 0 != memcmp(magic, COSTFILEMAGIC, sizeof(magic)) ||
+	    1 != fread(header, sizeof(header), 1, f) || header[0] != mp.B || header[1] != mp.T || header[2] < 0)
+		return false;
+	vector<Entry> entries(header[2]);
+	if (!entries.empty() && 1 != fread(&entries[0], entries.size() * sizeof(Entry), 1, f))
+		return false;
+	for (vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); it++)
+		costs[make_pair((int64_t)it->x, (int64_t)it->y)] = it->cost;
+	return true;
+}
+
+bool TileCostTable::writeFile(const string& outputpath, const MapParams& mp) const
+{
+	vector<Entry> entries;
+	entries.reserve(costs.size());
+	for (map<pair<int64_t, int64_t>, uint32_t>::const_iterator it = costs.begin(); it != costs.end(); it++)
+	{
+		Entry e;
+		e.x = it->first.first;
+		e.y = it->first.second;
+		e.cost = it->second;
+		entries.push_back(e);
+	}
+
+	// write to a temp file, then move it into place, so a crash can't leave a half-written file
+	string filename = outputpath + "/pigmap.costs";
+	string tempname = filename + ".tmp";
+	{
+		FILE *f = fopen(tempname.c_str(), "wb");
+		if (f == NULL)
+			return false;
+		fcloser fc(f);
+		int32_t header[3] = {mp.B, mp.T, (int32_t)entries.size()};
+		if (1 != fwrite(COSTFILEMAGIC, sizeof(COSTFILEMAGIC), 1, f) || 1 != fwrite(header, sizeof(header), 1, f))
+			return false;
+		if (!entries.empty() && 1 != fwrite(&entries[0], entries.size() * sizeof(Entry), 1, f))
+			return false;
+	}
+	renameFile(tempname, filename);
+	return true;
+}
+
+
+
+int64_t getTileCosts(TileTable& ttable, const ChunkTable& ctable, const MapParams& mp, const TileCostTable& measured,
+                     vector<pair<TileIdx, int64_t> >& tilecosts)
+{
+	// first pass: get the measured costs, and count the chunks for the tiles without them (and also for the
+	//  ones with them, so we can see how the two relate)
+	tilecosts.clear();
+	vector<int64_t> chunkcounts;
+	int64_t nmeasured = 0, measuredcost = 0, measuredchunks = 0;
+	for (RequiredTileIterator it(ttable); !it.end; it.advance())
+	{
+		TileIdx ti = it.current.toTileIdx();
+		vector<ChunkIdx> chunks = ti.getChunks(mp);
+		int64_t nchunks = 1;  // (so that no tile is free)
+		for (vector<ChunkIdx>::const_iterator cit = chunks.begin(); cit != chunks.end(); cit++)
+		{
+			PosChunkIdx ci(*cit);
+			if (ci.valid() && ctable.isRequired(ci))
+				nchunks++;
+		}
+		uint32_t cost;
+		if (measured.get(ti, cost))
+		{
+			nmeasured++;
+			measuredcost += cost;
+			measuredchunks += nchunks;
+			tilecosts.push_back(make_pair(ti, max((int64_t)cost, (int64_t)1)));
+			chunkcounts.push_back(-1);
+		}
+		else
+		{
+			tilecosts.push_back(make_pair(ti, nchunks));
+			chunkcounts.push_back(nchunks);
+		}
+	}
+
+	// second pass: if there were any measurements, convert the chunk counts into the same units; if
+	//  there weren't, the chunk counts are all we've got, so leave them as they are
+	if (nmeasured > 0 && nmeasured < (int64_t)tilecosts.size())
+	{
+		double costperchunk = (double)measuredcost / (double)measuredchunks;
+		for (size_t i = 0; i < tilecosts.size(); i++)
+			if (chunkcounts[i] != -1)
+				tilecosts[i].second = max((int64_t)(chunkcounts[i] * costperchunk), (int64_t)1);
+	}
+	return nmeasured;
+}
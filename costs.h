@@ -0,0 +1,58 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COSTS_H
+#define COSTS_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "map.h"
+#include "tables.h"
+
+
+// how long each base tile took to render the last time it was drawn, so that the threads can be given
+//  equal amounts of work instead of equal numbers of tiles
+// ...kept between runs in "pigmap.costs" in the output path
+struct TileCostTable
+{
+	struct Entry
+	{
+		int32_t x, y;  // TileIdx
+		uint32_t cost;  // microseconds
+	};
+
+	std::map<std::pair<int64_t, int64_t>, uint32_t> costs;
+
+	void set(const TileIdx& ti, uint32_t cost) {costs[std::make_pair(ti.x, ti.y)] = cost;}
+	bool get(const TileIdx& ti, uint32_t& cost) const;
+
+	// read/write pigmap.costs; the costs are only valid for the same B and T, so reading fails if
+	//  they've changed (as well as if the file is missing or corrupt)
+	bool readFile(const std::string& outputpath, const MapParams& mp);
+	bool writeFile(const std::string& outputpath, const MapParams& mp) const;
+};
+
+// get a cost for each required base tile: the measured one from the TileCostTable if there is one,
+//  otherwise an estimate based on the number of required chunks that the tile touches (scaled by the
+//  average measured cost per chunk, if there are any measurements to go by)
+// ...returns the number of tiles that had measured costs
+int64_t getTileCosts(TileTable& ttable, const ChunkTable& ctable, const MapParams& mp, const TileCostTable& measured,
+                     std::vector<std::pair<TileIdx, int64_t> >& tilecosts);
+
+
+#endif // COSTS_H
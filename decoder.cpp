@@ -0,0 +1,172 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <iostream>
+#include <algorithm>
+
+#include "decoder.h"
+
+using namespace std;
+
+
+
+int decodeChunk(const RegionFileReader& regionfile, const ChunkIdx& ci, ChunkData& data, uint16_t wanted, vector<uint8_t>& buf,
+                vector<uint8_t>& sectorbuf, Inflater& inflater)
+{
+	int result = regionfile.decompressChunk(ci, buf, sectorbuf, inflater);
+	if (result == -1)
+		return ChunkSet::CHUNK_MISSING;
+	if (result == -2)
+		return ChunkSet::CHUNK_CORRUPTED;
+	bool okay = regionfile.anvil ? data.loadFromAnvilFile(buf, wanted) : data.loadFromOldFile(buf, wanted);
+	return okay ? ChunkSet::CHUNK_CACHED : ChunkSet::CHUNK_CORRUPTED;
+}
+
+
+
+void *runDecoderThread(void *arg)
+{
+	ChunkDecoder::Helper *helper = (ChunkDecoder::Helper*)arg;
+	ChunkDecoder& cd = *helper->decoder;
+	ChunkDecoder::Batch *batch;
+	size_t idx;
+	while (cd.nextJob(batch, idx))
+	{
+		cd.doJob(batch, idx, helper->inflater, helper->buf, helper->sectorbuf);
+		mutexLocker ml(cd.mutex);
+		cd.helpercount++;
+	}
+	return 0;
+}
+
+ChunkDecoder::ChunkDecoder(int numthreads)
+	: stopping(true), batchcount(0), chunkcount(0), helpercount(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&workready, NULL);
+	pthread_cond_init(&batchdone, NULL);
+	for (int i = 0; i < numthreads; i++)
+	{
+		Helper *helper = new Helper;
+		helper->decoder = this;
+		helper->started = false;
+		helpers.push_back(helper);
+	}
+}
+
+ChunkDecoder::~ChunkDecoder()
+{
+	stop();
+	for (vector<Helper*>::iterator it = helpers.begin(); it != helpers.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&batchdone);
+	pthread_cond_destroy(&workready);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ChunkDecoder::start()
+{
+	stopping = false;
+	for (vector<Helper*>::iterator it = helpers.begin(); it != helpers.end(); it++)
+	{
+		(*it)->started = 0 == pthread_create(&(*it)->pthr, NULL, runDecoderThread, (void*)*it);
+		if (!(*it)->started)
+			cerr << "failed to create decoder thread!" << endl;
+	}
+}
+
+void ChunkDecoder::stop()
+{
+	{
+		mutexLocker ml(mutex);
+		stopping = true;
+		pthread_cond_broadcast(&workready);
+	}
+	// (any batches still in progress will be finished by the threads that own them)
+	for (vector<Helper*>::iterator it = helpers.begin(); it != helpers.end(); it++)
+		if ((*it)->started)
+		{
+			pthread_join((*it)->pthr, NULL);
+			(*it)->started = false;
+		}
+}
+
+void ChunkDecoder::decode(const RegionFileReader& regionfile, const vector<ChunkIdx>& chunks, vector<ChunkData>& data,
+                          vector<int>& states, uint16_t sections, Inflater& inflater, vector<uint8_t>& buf,
+                          vector<uint8_t>& sectorbuf)
+{
+	data.resize(chunks.size());
+	states.resize(chunks.size());
+	Batch batch;
+	batch.regionfile = &regionfile;
+	batch.chunks = &chunks;
+	batch.data = &data;
+	batch.states = &states;
+	batch.sections = sections;
+	batch.next = batch.finished = 0;
+	{
+		mutexLocker ml(mutex);
+		batches.push_back(&batch);
+		batchcount++;
+		chunkcount += chunks.size();
+		pthread_cond_broadcast(&workready);
+	}
+
+	// work on our own batch until there's nothing left to claim...
+	for (;;)
+	{
+		size_t idx;
+		{
+			mutexLocker ml(mutex);
+			if (batch.next == chunks.size())
+				break;
+			idx = batch.next++;
+		}
+		doJob(&batch, idx, inflater, buf, sectorbuf);
+	}
+
+	// ...then wait for the helpers to finish whatever they took, and take the batch off the list
+	mutexLocker ml(mutex);
+	while (batch.finished < chunks.size())
+		pthread_cond_wait(&batchdone, &mutex);
+	batches.erase(find(batches.begin(), batches.end(), &batch));
+}
+
+bool ChunkDecoder::nextJob(Batch*& batch, size_t& idx)
+{
+	mutexLocker ml(mutex);
+	while (!stopping)
+	{
+		for (vector<Batch*>::iterator it = batches.begin(); it != batches.end(); it++)
+			if ((*it)->next < (*it)->chunks->size())
+			{
+				batch = *it;
+				idx = batch->next++;
+				return true;
+			}
+		pthread_cond_wait(&workready, &mutex);
+	}
+	return false;
+}
+
+void ChunkDecoder::doJob(Batch *batch, size_t idx, Inflater& inflater, vector<uint8_t>& buf, vector<uint8_t>& sectorbuf)
+{
+	(*batch->states)[idx] = decodeChunk(*batch->regionfile, (*batch->chunks)[idx], (*batch->data)[idx], batch->sections, buf,
+	                                    sectorbuf, inflater);
+	mutexLocker ml(mutex);
+	if (++batch->finished == batch->chunks->size())
+		pthread_cond_broadcast(&batchdone);
+}
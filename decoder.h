@@ -0,0 +1,94 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "chunk.h"
+#include "region.h"
+#include "utils.h"
+
+
+#define DECODEBATCHMAX 128  // most chunks of a region to decode in one batch
+
+
+// decompress and parse a single chunk from a region file, keeping only the wanted sections; return the
+//  resulting disk state (CHUNK_CACHED for success)
+int decodeChunk(const RegionFileReader& regionfile, const ChunkIdx& ci, ChunkData& data, uint16_t wanted, std::vector<uint8_t>& buf,
+                std::vector<uint8_t>& sectorbuf, Inflater& inflater);
+
+// a pool of threads that help decode the chunks of a newly read region file all at once, so the inflating
+//  and parsing is spread over several CPUs, rather than done one chunk at a time by whichever render
+//  thread happens to need each chunk
+// ...a thread with a batch hands it to decode(), which works on the batch alongside the helpers, and
+//  returns once all of it is done
+struct ChunkDecoder : private nocopy
+{
+	struct Batch
+	{
+		const RegionFileReader *regionfile;  // read by all the threads at once (each with its own buffers)
+		const std::vector<ChunkIdx> *chunks;
+		std::vector<ChunkData> *data;  // one for each chunk
+		std::vector<int> *states;  // disk state of each chunk once decoded
+		uint16_t sections;  // which sections to keep (see sectionsForYRange)
+		size_t next;  // first chunk not yet claimed by a thread
+		size_t finished;  // chunks done
+	};
+
+	struct Helper
+	{
+		ChunkDecoder *decoder;
+		pthread_t pthr;
+		bool started;
+		Inflater inflater;
+		std::vector<uint8_t> buf, sectorbuf;
+	};
+
+	std::vector<Batch*> batches;  // all the batches in progress
+	bool stopping;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t workready;  // helpers wait here for a batch
+	pthread_cond_t batchdone;  // decode() waits here for the helpers to finish the last of its batch
+
+	std::vector<Helper*> helpers;
+	int64_t batchcount, chunkcount, helpercount;  // batches, chunks decoded, chunks done by the helpers
+
+	ChunkDecoder(int numthreads);
+	~ChunkDecoder();  // stops the threads, if they're still running
+
+	void start();
+	void stop();
+
+	// decode chunks from a region file into data (resized to fit), and set their states; the calling thread
+	//  does its share with its own inflater and buffers
+	void decode(const RegionFileReader& regionfile, const std::vector<ChunkIdx>& chunks, std::vector<ChunkData>& data,
+	            std::vector<int>& states, uint16_t sections, Inflater& inflater, std::vector<uint8_t>& buf,
+	            std::vector<uint8_t>& sectorbuf);
+
+	// for the helpers: claim a chunk from any batch; return false if stopping
+	bool nextJob(Batch*& batch, size_t& idx);
+	// decode a claimed chunk
+	void doJob(Batch *batch, size_t idx, Inflater& inflater, std::vector<uint8_t>& buf, std::vector<uint8_t>& sectorbuf);
+};
+
+
+#endif // DECODER_H
@@ -0,0 +1,171 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "manifest.h"
+#include "utils.h"
+
+using namespace std;
+
+
+#define MANIFESTMAGIC "pigmapmanifest1"
+
+struct fcloser
+{
+	FILE *f;
+	fcloser(FILE *ff) : f(ff) {}
+	~fcloser() {fclose(f);}
+};
+
+void WorldManifest::set(const RegionIdx& ri, const RegionFileReader& rfr)
+{
+	RegionEntry& entry = regions[make_pair(ri.x, ri.z)];
+	entry.offsets = rfr.offsets;
+	entry.timestamps = rfr.timestamps;
+}
+
+void WorldManifest::getChangedChunks(const RegionIdx& ri, const RegionFileReader& rfr, vector<ChunkIdx>& chunks) const
+{
+	chunks.clear();
+	map<pair<int64_t, int64_t>, RegionEntry>::const_iterator old = regions.find(make_pair(ri.x, ri.z));
+	for (RegionChunkIterator it(ri); !it.end; it.advance())
+	{
+		int idx = RegionFileReader::getIdx(it.current);
+		// a chunk that doesn't exist now and didn't before hasn't changed; otherwise, if we've never
+		//  seen the region, or the chunk's location or timestamp is different, it has
+		bool present = rfr.offsets[idx] != 0;
+		if (old == regions.end())
+		{
+			if (present)
+				chunks.push_back(it.current);
+		}
+		else if (rfr.offsets[idx] != old->second.offsets[idx] || (present && rfr.timestamps[idx] != old->second.timestamps[idx]))
+			chunks.push_back(it.current);
+	}
+}
+
+void WorldManifest::getDeletedChunks(const WorldManifest& current, vector<ChunkIdx>& chunks) const
+{
+	chunks.clear();
+	for (map<pair<int64_t, int64_t>, RegionEntry>::const_iterator rit = regions.begin(); rit != regions.end(); rit++)
+	{
+		if (current.regions.count(rit->first) > 0)
+			continue;
+		RegionIdx ri(rit->first.first, rit->first.second);
+		for (RegionChunkIterator it(ri); !it.end; it.advance())
+			if (rit->second.offsets[RegionFileReader::getIdx(it.current)] != 0)
+				chunks.push_back(it.current);
+	}
+}
+
+void WorldManifest::merge(const WorldManifest& other)
+{
+	RegionEntry empty;
+	empty.offsets.resize(32 * 32, 0);
+	empty.timestamps.resize(32 * 32, 0);
+	for (map<pair<int64_t, int64_t>, RegionEntry>::const_iterator it = other.regions.begin(); it != other.regions.end(); it++)
+		if (regions.count(it->first) == 0)
+			regions[it->first] = empty;
+	for (map<pair<int64_t, int64_t>, RegionEntry>::iterator it = regions.begin(); it != regions.end(); it++)
+	{
+		map<pair<int64_t, int64_t>, RegionEntry>::const_iterator oit = other.regions.find(it->first);
+		const RegionEntry& theirs = (oit == other.regions.end()) ? empty : oit->second;
+		RegionEntry& ours = it->second;
+		for (int idx = 0; idx < 32 * 32; idx++)
+			if (ours.offsets[idx] != theirs.offsets[idx] || (ours.offsets[idx] != 0 && ours.timestamps[idx] != theirs.timestamps[idx]))
+			{
+				ours.offsets[idx] = UNKNOWN_OFFSET;
+				ours.timestamps[idx] = 0;
+			}
+	}
+}
+
+// file format: magic string (with its terminating NUL), then the number of regions as an int32, then for
+//  each region its X and Z as int32s, followed by its 1024 offsets and 1024 timestamps exactly as they
+//  appear in the region header
+bool WorldManifest::readFile(const string& outputpath)
+{
+	regions.clear();
+	string filename = outputpath + "/pigmap.manifest";
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return false;
+	fcloser fc(f);
+
+	char magic[sizeof(MANIFESTMAGIC)];
+	if (1 != fread(magic, sizeof(magic), 1, f) || 0 != memcmp(magic, MANIFESTMAGIC, sizeof(magic)))
+		return false;
+	return read(f);
+}
+
+bool WorldManifest::read(FILE *f)
+{
+	regions.clear();
+	int32_t count;
+	if (1 != fread(&count, sizeof(count), 1, f) || count < 0)
+		return false;
+	for (int32_t i = 0; i < count; i++)
+	{
+		int32_t coords[2];
+		if (1 != fread(coords, sizeof(coords), 1, f))
+		{
+			regions.clear();
+			return false;
+		}
+		RegionEntry& entry = regions[make_pair((int64_t)coords[0], (int64_t)coords[1])];
+		entry.offsets.resize(32 * 32);
+		entry.timestamps.resize(32 * 32);
+		if (1 != fread(&(entry.offsets[0]), 4096, 1, f) || 1 != fread(&(entry.timestamps[0]), 4096, 1, f))
+		{
+			regions.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool WorldManifest::writeFile(const string& outputpath) const
+{
+	// write to a temp file, then move it into place, so a crash can't leave a half-written file
+	string filename = outputpath + "/pigmap.manifest";
+	string tempname = filename + ".tmp";
+	{
+		FILE *f = fopen(tempname.c_str(), "wb");
+		if (f == NULL)
+			return false;
+		fcloser fc(f);
+		if (1 != fwrite(MANIFESTMAGIC, sizeof(MANIFESTMAGIC), 1, f) || !write(f))
+			return false;
+	}
+	renameFile(tempname, filename);
+	return true;
+}
+
+bool WorldManifest::write(FILE *f) const
+{
+	int32_t count = regions.size();
+	if (1 != fwrite(&count, sizeof(count), 1, f))
+		return false;
+	for (map<pair<int64_t, int64_t>, RegionEntry>::const_iterator it = regions.begin(); it != regions.end(); it++)
+	{
+		int32_t coords[2] = {(int32_t)it->first.first, (int32_t)it->first.second};
+		if (1 != fwrite(coords, sizeof(coords), 1, f) ||
+		    1 != fwrite(&(it->second.offsets[0]), 4096, 1, f) || 1 != fwrite(&(it->second.timestamps[0]), 4096, 1, f))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,70 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "map.h"
+#include "region.h"
+
+
+// where each chunk was in its region file, and when it was last modified, as of the last render; the
+//  next render can compare this against the current region headers to find out what has changed, without
+//  needing a regionlist
+// ...kept between runs in "pigmap.manifest" in the output path
+struct WorldManifest
+{
+	struct RegionEntry
+	{
+		std::vector<uint32_t> offsets, timestamps;  // straight from the region header (so big-endian)
+	};
+
+	// offset recorded for a chunk whose state isn't known (because the shards of a render saw different
+	//  versions of it); no real region header has it, so the next render will always redraw the chunk
+	static const uint32_t UNKNOWN_OFFSET = 0xffffffff;
+
+	std::map<std::pair<int64_t, int64_t>, RegionEntry> regions;
+
+	// record the header of a region file (read by RegionFileReader::loadHeaderOnly)
+	void set(const RegionIdx& ri, const RegionFileReader& rfr);
+	// get the chunks in a region file that aren't the same as last time: ones that have been modified, moved
+	//  within the file, created, or deleted
+	void getChangedChunks(const RegionIdx& ri, const RegionFileReader& rfr, std::vector<ChunkIdx>& chunks) const;
+	// get the chunks that existed last time in regions other than the ones given (i.e. regions that have
+	//  since been deleted entirely)
+	void getDeletedChunks(const WorldManifest& current, std::vector<ChunkIdx>& chunks) const;
+
+	// combine this with the manifest from another shard of the same render: the shards may have scanned
+	//  the world at different times, so any chunk they disagree about is marked UNKNOWN_OFFSET
+	// (a region one of them didn't see counts as having no chunks)
+	void merge(const WorldManifest& other);
+
+	// read/write pigmap.manifest; reading fails if the file is missing or corrupt
+	bool readFile(const std::string& outputpath);
+	bool writeFile(const std::string& outputpath) const;
+	// read/write just the contents (as found in pigmap.manifest after the magic string), at the current
+	//  position in an open file; used to carry the manifest in shard handoff files
+	bool read(FILE *f);
+	bool write(FILE *f) const;
+};
+
+
+#endif // MANIFEST_H
@@ -283,6 +283,27 @@ BBox TileIdx::getBBox(const MapParams& mp) const
 	return BBox(tl, tl + Pixel(mp.tileSize(), mp.tileSize()));
 }
 
+vector<ChunkIdx> TileIdx::getChunks(const MapParams& mp) const
+{
+	// in terms of s = cx + cz and d = cz - cx (relative to the base chunk), a chunk's origin block is
+	//  centered at [32Bs, 16Bd] relative to the base chunk's, so its bounding box can only reach the
+	//  tile's if -1 <= s <= 2T - 1 and 2*MINY/16 - 4T < d < (34 + 2*MAXY)/16; check the bounding boxes
+	//  of everything in that range
+	BBox bbtile = getBBox(mp);
+	ChunkIdx cibase = baseChunk(mp);
+	vector<ChunkIdx> chunks;
+	for (int64_t s = -1; s <= 2*mp.T - 1; s++)
+		for (int64_t d = (2*mp.minY)/16 - 4*mp.T - 1; d <= (34 + 2*mp.maxY)/16 + 1; d++)
+		{
+			if ((s + d) % 2 != 0)
+				continue;
+			ChunkIdx ci = cibase + ChunkIdx((s - d) / 2, (s + d) / 2);
+			if (ci.getBBox(mp).overlaps(bbtile))
+				chunks.push_back(ci);
+		}
+	return chunks;
+}
+
 ZoomTileIdx TileIdx::toZoomTileIdx(const MapParams& mp) const
 {
 	// adjust by offset
@@ -335,6 +335,10 @@ struct TileIdx
 	BBox getBBox(const MapParams& mp) const;
 	ZoomTileIdx toZoomTileIdx(const MapParams& mp) const;
 
+	// get the chunks whose bounding boxes intersect this tile's (i.e. the ones that might have to be
+	//  read to draw it)
+	std::vector<ChunkIdx> getChunks(const MapParams& mp) const;
+
 	TileIdx& operator+=(const TileIdx& t) {x += t.x; y += t.y; return *this;}
 	TileIdx& operator-=(const TileIdx& t) {x -= t.x; y -= t.y; return *this;}
 	bool operator==(const TileIdx& t) const {return t.x == x && t.y == y;}
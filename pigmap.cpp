@@ -27,7 +27,6 @@
 // -premultiply block image alphas?
 // -dump list of corrupted chunks at end, so they can be retried later
 // -keep some space around for PNG row pointers instead of allocating every time
-// -see if it's better to have threads work together and share a cache?
 // -for the love of god, clean up blockimages.cpp!
 //
 
@@ -43,15 +42,25 @@
 #include <time.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <getopt.h>
 
+#include "affinity.h"
 #include "blockimages.h"
 #include "rgba.h"
+#include "manifest.h"
 #include "map.h"
 #include "utils.h"
 #include "tables.h"
 #include "chunk.h"
+#include "costs.h"
 #include "render.h"
 #include "world.h"
+#include "prefetch.h"
+#include "region.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "writer.h"
+#include "decoder.h"
 
 using namespace std;
 
@@ -66,9 +75,12 @@ void printStats(int seconds, const RenderStats& stats)
 	cout << "chunk cache: " << stats.chunkcache.hits << " hits   " << stats.chunkcache.misses << " misses" << endl;
 	cout << "             " << stats.chunkcache.read << " read   " << stats.chunkcache.skipped << " skipped   " << stats.chunkcache.missing << " missing   "
 	     << stats.chunkcache.reqmissing << " reqmissing   " << stats.chunkcache.corrupt << " corrupt" << endl;
+	cout << "             " << stats.chunkcache.conflict << " conflict   " << stats.chunkcache.capacity << " capacity   "
+	     << stats.chunkcache.batched << " batched" << endl;
 	cout << "region cache: " << stats.regioncache.hits << " hits   " << stats.regioncache.misses << " misses" << endl;
 	cout << "              " << stats.regioncache.read << " read   " << stats.regioncache.skipped << " skipped   " << stats.regioncache.missing << " missing   "
-	     << stats.regioncache.reqmissing << " reqmissing   " << stats.regioncache.corrupt << " corrupt" << endl;
+	     << stats.regioncache.reqmissing << " reqmissing   " << stats.regioncache.corrupt << " corrupt   " << stats.regioncache.reread << " reread" << endl;
+	cout << "              " << stats.regioncache.partial << " partial reads" << endl;
 #if USE_MALLINFO
 	cout << "heap usage: " << stats.heapusage << " bytes" << endl;
 #endif
@@ -78,13 +90,32 @@ void runSingleThread(RenderJob& rj)
 {
 	cout << "single thread will render " << rj.stats.reqtilecount << " base tiles" << endl;
 	// allocate storage/caches
-	rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache));
-	rj.chunkcache.reset(new ChunkCache(*rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache));
+	rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache, RenderSettings::regionCacheBudget));
+	rj.chunkcache.reset(new ChunkCache(RenderSettings::chunkCacheBudget, 1 + RenderSettings::prefetchThreads));
+	rj.chunkreader.reset(new ChunkCacheReader(*rj.chunkcache, *rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache));
+	rj.chunkreader->decoder = rj.decoder;
+	rj.chunkreader->sections = sectionsForYRange(rj.mp);
 	rj.tilecache.reset(new TileCache(rj.mp));
 	rj.scenegraph.reset(new SceneGraph);
+	// if requested, start up the prefetch threads, and point them at the whole map
+	auto_ptr<Prefetcher> prefetcher;
+	if (!rj.testmode && RenderSettings::prefetchThreads > 0)
+	{
+		prefetcher.reset(new Prefetcher(RenderSettings::prefetchThreads, 1, *rj.chunkcache, *rj.chunktable, *rj.regiontable, *rj.tiletable,
+		                                rj.mp, rj.inputpath, rj.fullrender, rj.regionformat, RenderSettings::regionCacheBudget, rj.decoder));
+		rj.prefetch = prefetcher->cursors[0];
+		rj.prefetch->startTask(ZoomTileIdx(0,0,0));
+		prefetcher->start();
+	}
 	RGBAImage topimg;
 	// render the tiles recursively (starting at the very top)
 	renderZoomTile(ZoomTileIdx(0,0,0), rj, topimg);
+	if (prefetcher.get() != NULL)
+	{
+		int64_t tiles = prefetcher->stop(rj.stats.chunkcache, rj.stats.regioncache);
+		cout << "prefetch threads loaded chunks for " << tiles << " base tiles" << endl;
+		rj.prefetch = NULL;
+	}
 	// get memory stats
 	rj.stats.heapusage = getHeapUsage();
 }
@@ -92,81 +123,119 @@ void runSingleThread(RenderJob& rj)
 struct WorkerThreadParams
 {
 	RenderJob *rj;
-	ThreadOutputCache *tocache;
-	vector<ZoomTileIdx> zoomtiles;  // tiles that this thread is responsible for
+	ChunkCache *chunkcache;  // shared by all the threads
+	TileScheduler *scheduler;
+	int thread;  // index into the scheduler's deques
+	int cpu;  // CPU to pin the thread to, or -1 to let it float
+	vector<ZoomTileIdx> zoomtiles;  // tiles initially assigned to this thread (others may steal them)
 };
 
 void *runWorkerThread(void *arg)
 {
 	WorkerThreadParams *wtp = (WorkerThreadParams*)arg;
-	for (vector<ZoomTileIdx>::const_iterator it = wtp->zoomtiles.begin(); it != wtp->zoomtiles.end(); it++)
+	if (wtp->cpu != -1 && !pinThread(wtp->cpu))
+		cerr << "failed to pin thread " << wtp->thread << " to CPU " << wtp->cpu << endl;
+
+	// allocate our storage from within the thread, so that (if we're pinned) it ends up on our own
+	//  NUMA node; this includes the images in the ThreadOutputCache, which are allocated by whoever
+	//  renders into them
+	RenderJob& rj = *wtp->rj;
+	if (!rj.testmode)
+	{
+		rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache, RenderSettings::regionCacheBudget));
+		rj.chunkreader.reset(new ChunkCacheReader(*wtp->chunkcache, *rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache));
+		rj.chunkreader->decoder = rj.decoder;
+		rj.chunkreader->sections = sectionsForYRange(rj.mp);
+		rj.scenegraph.reset(new SceneGraph);
+	}
+	rj.tilecache.reset(new TileCache(rj.mp));
+
+	TileTask task;
+	while (wtp->scheduler->getTask(wtp->thread, task))
 	{
-		int idx = wtp->tocache->getIndex(*it);
-		wtp->tocache->used[idx] = renderZoomTile(*it, *wtp->rj, wtp->tocache->images[idx]);
+		if (wtp->scheduler->splitTask(wtp->thread, task))
+			continue;
+		if (wtp->rj->prefetch != NULL)
+			wtp->rj->prefetch->startTask(task.zti);
+		bool used = renderZoomTile(task.zti, *wtp->rj, wtp->scheduler->getOutput(task));
+		wtp->scheduler->finishTask(task, used, *wtp->rj);
 	}
 	return 0;
 }
 
-// see if there's enough available memory for some number of tile images
-// (...by just attempting to allocate it!)
-//!!!!!!! better way to do this?   maybe allow user to specify max memory for
-//         ThreadOutputCache instead?
-bool memoryAvailable(int tiles, const MapParams& mp)
+struct TopLevelParams
 {
-	int64_t imgsize = mp.tileSize() * mp.tileSize();  // in pixels
-	try
-	{
-		RGBAPixel *tempbuf = new RGBAPixel[imgsize * tiles];
-		delete[] tempbuf;
-	}
-	catch (bad_alloc& ba)
+	RenderJob *rj;
+	const ThreadOutputCache *below;
+	ThreadOutputCache *above;
+	int64_t *nexttile;  // next index into above->images to be built (shared by all the threads)
+};
+
+void *runTopLevelThread(void *arg)
+{
+	TopLevelParams *tlp = (TopLevelParams*)arg;
+	int64_t size = 1 << tlp->above->zoom;
+	for (int64_t idx = __sync_fetch_and_add(tlp->nexttile, 1); idx < size * size; idx = __sync_fetch_and_add(tlp->nexttile, 1))
 	{
-		return false;
+		ZoomTileIdx zti(idx % size, idx / size, tlp->above->zoom);
+		tlp->above->store(idx, combineZoomTile(zti, *tlp->rj, tlp->above->images[idx], *tlp->below));
 	}
-	return true;
+	return 0;
 }
 
-// returns zoom level chosen for partitioning
-int assignThreadTasks(vector<WorkerThreadParams>& wtps, const TileTable& ttable, const MapParams& mp, int threads)
+// returns zoom level chosen for partitioning (minzoom or greater)
+// ...tilecosts holds the (measured or estimated) cost of each required base tile
+int assignThreadTasks(vector<WorkerThreadParams>& wtps, const vector<pair<TileIdx, int64_t> >& tilecosts, const MapParams& mp, int threads, int64_t budget, int minzoom)
 {
+	// the average tile cost, for turning numbers of tiles into costs
+	int64_t totalcost = 0;
+	for (vector<pair<TileIdx, int64_t> >::const_iterator it = tilecosts.begin(); it != tilecosts.end(); it++)
+		totalcost += it->second;
+	int64_t avgcost = max(totalcost / max((int64_t)tilecosts.size(), (int64_t)1), (int64_t)1);
+
 	vector<ZoomTileIdx> best_reqzoomtiles;
-	vector<int64_t> best_costs;
+	vector<int64_t> best_numreqs;
 	vector<int> best_assignments;
 	double best_error = 1.1;
-	// start with zoom level 1 and go up from there
-	for (int zoom = 1; zoom <= mp.baseZoom; zoom++)
+	// start with zoom level minzoom (normally 1) and go up from there
+	for (int zoom = minzoom; zoom <= mp.baseZoom; zoom++)
 	{
 		// find all zoom tiles at this level that need to be drawn (i.e. contain > 0 required base tiles),
-		//  and their costs (number of required base tiles)
+		//  and their costs (total cost of their required base tiles)
+		map<pair<int64_t, int64_t>, pair<int64_t, int64_t> > zoomcosts;  // [x,y] -> (cost, number of base tiles)
+		for (vector<pair<TileIdx, int64_t> >::const_iterator it = tilecosts.begin(); it != tilecosts.end(); it++)
+		{
+			ZoomTileIdx zti = it->first.toZoomTileIdx(mp).toZoom(zoom);
+			pair<int64_t, int64_t>& zc = zoomcosts[make_pair(zti.x, zti.y)];
+			zc.first += it->second;
+			zc.second++;
+		}
 		vector<ZoomTileIdx> reqzoomtiles;
-		vector<int64_t> costs;
+		vector<int64_t> costs, numreqs;
 		vector<int> assignments;
-		int64_t size = (1 << zoom);
-		ZoomTileIdx zti(-1, -1, zoom);
-		for (zti.x = 0; zti.x < size; zti.x++)
-			for (zti.y = 0; zti.y < size; zti.y++)
-			{
-				int numreq = ttable.getNumRequired(zti, mp);
-				if (numreq > 0)
-				{
-					reqzoomtiles.push_back(zti);
-					costs.push_back(numreq);
-				}
-			}
+		for (map<pair<int64_t, int64_t>, pair<int64_t, int64_t> >::const_iterator it = zoomcosts.begin(); it != zoomcosts.end(); it++)
+		{
+			reqzoomtiles.push_back(ZoomTileIdx(it->first.first, it->first.second, zoom));
+			costs.push_back(it->second.first);
+			numreqs.push_back(it->second.second);
+		}
 		// if there are too many tiles at this zoom level (that is, if the ThreadOutputCache wouldn't
-		//  fit in memory), then forget it (and those above it, too)
-		if (!memoryAvailable(reqzoomtiles.size(), mp))
+		//  fit in the memory budget), then forget it (and those below it, too)
+		// ...unless this is the first level, in which case we're stuck with it, and will have to spill
+		//  some of the tiles to disk
+		int64_t imgsize = mp.tileSize() * mp.tileSize() * sizeof(RGBAPixel);
+		if (zoom > minzoom && (int64_t)reqzoomtiles.size() * imgsize > budget)
 			break;
 		// compute a good schedule for this level and get its "error" (difference between max thread
 		//  cost and min thread cost, as a fraction of max thread cost)
 		pair<int64_t, double> error = schedule(costs, assignments, threads);
-		// if the error is less than 5%, or under 50 tiles (for small worlds), that's good enough
-		bool stop = error.second < 0.05 || error.first < 50;
+		// if the error is less than 5%, or under 50 tiles' worth (for small worlds), that's good enough
+		bool stop = error.second < 0.05 || error.first < 50 * avgcost;
 		// if this error is the best so far, remember these tiles/assignments
 		if (error.second < best_error || stop)
 		{
 			best_reqzoomtiles = reqzoomtiles;
-			best_costs = costs;
+			best_numreqs = numreqs;
 			best_assignments = assignments;
 			best_error = error.second;
 		}
@@ -178,16 +247,83 @@ int assignThreadTasks(vector<WorkerThreadParams>& wtps, const TileTable& ttable,
 	for (uint i = 0; i < best_assignments.size(); i++)
 	{
 		wtps[best_assignments[i]].zoomtiles.push_back(best_reqzoomtiles[i]);
-		wtps[best_assignments[i]].rj->stats.reqtilecount += best_costs[i];
+		wtps[best_assignments[i]].rj->stats.reqtilecount += best_numreqs[i];
 	}
 
 	return best_reqzoomtiles.front().zoom;
 }
 
-void runMultithreaded(RenderJob& rj, int threads)
+// get the memory budget for the images passed between zoom levels
+int64_t getMemoryBudget()
 {
+	int64_t budget = RenderSettings::memoryBudget;
+	if (budget == 0)
+		budget = getPhysicalMemory() / 2;
+	if (budget == 0)
+		budget = 1024 * 1048576;
+	return budget;
+}
+
+// build the zoom levels above a ThreadOutputCache, up to the level stopzoom; each level only depends on the
+//  one below it, so the threads can split each level up between them, and we can throw away the images
+//  from the level below as soon as a level is finished
+// ...on return, tocache holds the images at stopzoom
+void buildTopLevels(RenderJob *rjs, int threads, auto_ptr<ThreadOutputCache>& tocache, int stopzoom, int64_t budget)
+{
+	const RenderJob& rj = rjs[0];
+	vector<pthread_t> pthrs(threads);
+	int64_t imgsize = rj.mp.tileSize() * rj.mp.tileSize() * sizeof(RGBAPixel);
+	for (int zoom = tocache->zoom - 1; zoom >= stopzoom; zoom--)
+	{
+		// the level below is held until this one is finished, and each thread has a tile in progress, so
+		//  this level only gets what's left of the budget after those (but at least 1 byte, since 0 would
+		//  mean no limit)
+		int levelthreads = min(threads, 1 << (2 * zoom));
+		int64_t abovebudget = max(budget - tocache->inmemory - levelthreads * imgsize, (int64_t)1);
+		auto_ptr<ThreadOutputCache> above(new ThreadOutputCache(zoom, abovebudget, rj.testmode ? "" : rj.outputpath));
+		int64_t nexttile = 0;
+		vector<TopLevelParams> tlps(levelthreads);
+		for (int i = 0; i < levelthreads; i++)
+		{
+			tlps[i].rj = &rjs[i];
+			tlps[i].below = tocache.get();
+			tlps[i].above = above.get();
+			tlps[i].nexttile = &nexttile;
+			if (0 != pthread_create(&pthrs[i], NULL, runTopLevelThread, (void*)&tlps[i]))
+			{
+				cerr << "failed to create thread!" << endl;
+				runTopLevelThread((void*)&tlps[i]);
+				pthrs[i] = pthread_self();
+			}
+		}
+		for (int i = 0; i < levelthreads; i++)
+			if (!pthread_equal(pthrs[i], pthread_self()))
+				pthread_join(pthrs[i], NULL);
+		if (tocache->spillend > 0)
+			cout << "zoom level " << tocache->zoom << ": " << tocache->spillend / (rj.mp.tileSize() * rj.mp.tileSize() * sizeof(RGBAPixel))
+			     << " tiles spilled to disk" << endl;
+		tocache = above;
+	}
+}
+
+// returns false if this is a shard and its handoff file couldn't be written
+// ...manifest goes into the handoff file (NULL if the world isn't in region format)
+bool runMultithreaded(RenderJob& rj, int threads, const TileCostTable& costtable, const ShardSpec& shard,
+                      const WorldManifest *manifest)
+{
+	// all the threads share one chunk cache, so chunks on the borders between their areas only get
+	//  read once
+	if (!rj.testmode)
+		rj.chunkcache.reset(new ChunkCache(RenderSettings::chunkCacheBudget, threads + RenderSettings::prefetchThreads));
+	// the prefetch threads (if any) follow the render threads around, loading chunks into the shared
+	//  cache just before they're needed
+	auto_ptr<Prefetcher> prefetcher;
+	if (!rj.testmode && RenderSettings::prefetchThreads > 0)
+		prefetcher.reset(new Prefetcher(RenderSettings::prefetchThreads, threads, *rj.chunkcache, *rj.chunktable, *rj.regiontable, *rj.tiletable,
+		                                rj.mp, rj.inputpath, rj.fullrender, rj.regionformat, RenderSettings::regionCacheBudget, rj.decoder));
+
 	// create a separate RenderJob for each thread; each one gets its own copy of the parameters,
-	//  plus its own storage (caches, scenegraph, etc.)
+	//  plus its own storage (region cache, scenegraph, etc.)
 	RenderJob *rjs = new RenderJob[threads];
 	arrayDeleter<RenderJob> adrj(rjs);
 	for (int i = 0; i < threads; i++)
@@ -199,46 +335,80 @@ void runMultithreaded(RenderJob& rj, int threads)
 		rjs[i].inputpath = rj.inputpath;
 		rjs[i].outputpath = rj.outputpath;
 		rjs[i].blockimages = rj.blockimages;
-		rjs[i].chunktable.reset(new ChunkTable);
-		rjs[i].chunktable->copyFrom(*rj.chunktable);
-		rjs[i].tiletable.reset(new TileTable);
-		rjs[i].tiletable->copyFrom(*rj.tiletable);
-		rjs[i].regiontable.reset(new RegionTable);
-		rjs[i].regiontable->copyFrom(*rj.regiontable);
-		if (!rjs[i].testmode)
-		{
-			rjs[i].regioncache.reset(new RegionCache(*rjs[i].chunktable, *rjs[i].regiontable, rjs[i].inputpath, rjs[i].fullrender, rjs[i].stats.regioncache));
-			rjs[i].chunkcache.reset(new ChunkCache(*rjs[i].chunktable, *rjs[i].regiontable, *rjs[i].regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache));
-			rjs[i].scenegraph.reset(new SceneGraph);
-		}
-		rjs[i].tilecache.reset(new TileCache(rjs[i].mp));
+		rjs[i].chunktable = rj.chunktable;
+		rjs[i].tiletable = rj.tiletable;
+		rjs[i].regiontable = rj.regiontable;
+		if (prefetcher.get() != NULL)
+			rjs[i].prefetch = prefetcher->cursors[i];
+		rjs[i].writer = rj.writer;
+		rjs[i].decoder = rj.decoder;
+		// (the region cache, scenegraph, etc. are allocated by the thread itself)
 	}
 
 	// divide the required tiles evenly among the threads: find a zoom level that has enough tiles for us
 	//  to make a balanced assignment, then give each thread some tiles from that level
 	vector<WorkerThreadParams> wtps(threads);
 	for (int i = 0; i < threads; i++)
+	{
 		wtps[i].rj = &rjs[i];
-	int threadzoom = assignThreadTasks(wtps, *rj.tiletable, rj.mp, threads);
+		wtps[i].chunkcache = rj.chunkcache.get();
+		wtps[i].cpu = -1;
+	}
+	// if requested, pin each thread to its own CPU, spreading them out over the NUMA nodes
+	if (RenderSettings::pinThreads)
+	{
+		vector<CPUPlacement> placements = getCPUPlacements();
+		if (placements.empty())
+			cerr << "can't get CPU layout; threads will not be pinned" << endl;
+		for (int i = 0; i < threads && !placements.empty(); i++)
+		{
+			const CPUPlacement& cp = placements[i % placements.size()];
+			wtps[i].cpu = cp.cpu;
+			if (RenderSettings::extraStats)
+				cout << "thread " << i << " pinned to CPU " << cp.cpu << " (node " << cp.node << ")" << endl;
+		}
+	}
+	// (if this is a shard, only the tiles in the shard count, and the threads can't start any higher
+	//  than the shard level)
+	int64_t budget = getMemoryBudget();
+	vector<pair<TileIdx, int64_t> > tilecosts;
+	int64_t nmeasured = getTileCosts(*rj.tiletable, *rj.chunktable, rj.mp, costtable, tilecosts);
+	cout << nmeasured << " of " << tilecosts.size() << " base tiles have costs from a previous render" << endl;
+	if (shard.active())
+	{
+		vector<pair<TileIdx, int64_t> > shardcosts;
+		for (vector<pair<TileIdx, int64_t> >::const_iterator it = tilecosts.begin(); it != tilecosts.end(); it++)
+			if (shard.contains(it->first, rj.mp))
+				shardcosts.push_back(*it);
+		tilecosts.swap(shardcosts);
+		cout << "shard " << shard.shard + 1 << "/" << shard.numshards << " has " << tilecosts.size() << " base tiles" << endl;
+	}
+	int threadzoom = shard.active() ? shard.zoom : 1;
+	if (!tilecosts.empty())
+		threadzoom = assignThreadTasks(wtps, tilecosts, rj.mp, threads, budget, threadzoom);
 	for (int i = 0; i < threads; i++)
-		cout << "thread " << i << " will render " << rjs[i].stats.reqtilecount << " base tiles" << endl;
+		cout << "thread " << i << " will start with " << rjs[i].stats.reqtilecount << " base tiles" << endl;
 
 	// allocate storage for the threads to store their rendered zoom tiles into
-	// (doesn't need to be synchronized, because threads only touch the images for their own
-	//  zoom tiles)
-	auto_ptr<ThreadOutputCache> tocache(new ThreadOutputCache(threadzoom));
+	// (doesn't need to be synchronized, because each zoom tile is rendered by exactly one thread,
+	//  even if it's not the one it was initially assigned to)
+	// ...if the tiles don't fit in the budget after all, the overflow is kept in a file in the output path
+	auto_ptr<ThreadOutputCache> tocache(new ThreadOutputCache(threadzoom, budget, rj.testmode ? "" : rj.outputpath));
+	// the initial assignments just seed the threads' deques; anyone who runs out of work steals
+	//  from the others, and splits the last few tiles into smaller pieces
+	TileScheduler scheduler(threads, *rj.tiletable, rj.mp, *tocache);
 	for (int i = 0; i < threads; i++)
 	{
-		wtps[i].tocache = tocache.get();
+		wtps[i].scheduler = &scheduler;
+		wtps[i].thread = i;
 		for (vector<ZoomTileIdx>::const_iterator it = wtps[i].zoomtiles.begin(); it != wtps[i].zoomtiles.end(); it++)
-		{
-			int idx = tocache->getIndex(*it);
-			tocache->images[idx].create(rj.mp.tileSize(), rj.mp.tileSize());  // reserve the memory
-		}
+			scheduler.addTask(i, TileTask(*it, NULL, -1));
 	}
 
-	// run the threads; each one renders all the zoom tiles assigned to it
+	// run the threads; each one renders zoom tiles until there are none left
 	cout << "running threads..." << endl;
+	if (prefetcher.get() != NULL)
+		prefetcher->start();
 	vector<pthread_t> pthrs(threads);
 	for (int i = 0; i < threads; i++)
 	{
@@ -249,31 +419,38 @@ void runMultithreaded(RenderJob& rj, int threads)
 	{
 		pthread_join(pthrs[i], NULL);
 	}
+	scheduler.printStats();
+	if (prefetcher.get() != NULL)
+	{
+		int64_t tiles = prefetcher->stop(rj.stats.chunkcache, rj.stats.regioncache);
+		cout << "prefetch threads loaded chunks for " << tiles << " base tiles" << endl;
+	}
 
-	// now that the threads are done, render the final zoom levels (the ones above the ThreadOutputCache level)
+	// now that the threads are done, render the final zoom levels (the ones above the ThreadOutputCache level),
+	//  or, if this is a shard, just the ones down to the shard level, and save those for the merge
 	cout << "finishing top zoom levels..." << endl;
-	rj.tilecache.reset(new TileCache(rj.mp));
-	RGBAImage topimg;
-	renderZoomTile(ZoomTileIdx(0,0,0), rj, topimg, *tocache);
+	buildTopLevels(rjs, threads, tocache, shard.active() ? shard.zoom : 0, budget);
+	bool result = true;
+	if (shard.active() && !rj.testmode)
+	{
+		if (writeShardFile(rj.outputpath, shard, rj.mp, rj.fullrender, tocache.get(), manifest))
+			cout << "wrote " << shardFilePath(rj.outputpath, shard.shard, shard.numshards) << endl;
+		else
+		{
+			cerr << "failed to write " << shardFilePath(rj.outputpath, shard.shard, shard.numshards) << endl;
+			result = false;
+		}
+	}
 
 	// combine the thread stats
 	for (int i = 0; i < threads; i++)
 	{
 		rj.stats.chunkcache += rjs[i].stats.chunkcache;
 		rj.stats.regioncache += rjs[i].stats.regioncache;
+		rj.tilecosts.insert(rj.tilecosts.end(), rjs[i].tilecosts.begin(), rjs[i].tilecosts.end());
 	}
 	rj.stats.heapusage = getHeapUsage();
-
-	// copy the drawn flags over from the thread TileTables (for the double-check)
-	for (RequiredTileIterator it(*rj.tiletable); !it.end; it.advance())
-	{
-		for (int i = 0; i < threads; i++)
-			if (rjs[i].tiletable->isDrawn(it.current))
-			{
-				rj.tiletable->setDrawn(it.current);
-				break;
-			}
-	}
+	return result;
 }
 
 bool expandMap(const string& outputpath)
@@ -415,13 +592,133 @@ void writeHTML(const RenderJob& rj, const string& htmlpath)
 	copyFile(htmlpath + "/style.css", rj.outputpath + "/style.css");
 }
 
-bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, int threads, int testworldsize, bool expand, const string& htmlpath)
+// build the top of the map from the handoff files left by a sharded render
+bool performMerge(const string& outputpath, const string& htmlpath, int threads)
+{
+	time_t tstart = time(NULL);
+
+	// the shards will have written the map params, as for any other render
+	MapParams mp;
+	if (!mp.readFile(outputpath))
+	{
+		cerr << "pigmap.params missing or corrupt" << endl;
+		return false;
+	}
+
+	// find out how many shards there are (and at what level) from the handoff files, which must all
+	//  agree (the shards clear out any with a different count, and a successful merge removes them all)
+	vector<string> files = listShardFiles(outputpath);
+	if (files.empty())
+	{
+		cerr << "no shard files found in " << outputpath << "/shards" << endl;
+		return false;
+	}
+	ShardSpec spec;
+	for (vector<string>::const_iterator it = files.begin(); it != files.end(); it++)
+	{
+		ShardSpec filespec;
+		if (0 != readShardHeader(*it, filespec))
+		{
+			cerr << *it << " is corrupt" << endl;
+			return false;
+		}
+		if (it != files.begin() && (filespec.numshards != spec.numshards || filespec.zoom != spec.zoom))
+		{
+			cerr << "shard files in " << outputpath << "/shards are from different renders; remove the stale ones" << endl;
+			return false;
+		}
+		spec = filespec;
+	}
+	cout << "merging " << spec.numshards << " shards at zoom level " << spec.zoom << "..." << endl;
+
+	// read all the handoff images; they must all be there, and they must all agree
+	// ...the shards' manifests are combined, so the next --auto-incremental redraws anything that changed
+	//  while they were running
+	int64_t budget = getMemoryBudget();
+	auto_ptr<ThreadOutputCache> tocache(new ThreadOutputCache(spec.zoom, budget, outputpath));
+	bool fullrender = true;
+	WorldManifest manifest;
+	bool regionformat = true;
+	for (int k = 0; k < spec.numshards; k++)
+	{
+		string filename = shardFilePath(outputpath, k, spec.numshards);
+		ShardSpec filespec;
+		bool filefull, hasmanifest;
+		WorldManifest filemanifest;
+		int result = readShardFile(filename, mp, filespec, filefull, *tocache, filemanifest, hasmanifest);
+		if (result == -1)
+		{
+			cerr << filename << " is missing; has shard " << k + 1 << " finished?" << endl;
+			return false;
+		}
+		if (result == -2 || filespec.shard != k || filespec.numshards != spec.numshards)
+		{
+			cerr << filename << " is corrupt, or doesn't match the other shards or pigmap.params" << endl;
+			return false;
+		}
+		if (k == 0)
+			fullrender = filefull;
+		else if (filefull != fullrender)
+		{
+			cerr << "shards disagree about whether this is a full render" << endl;
+			return false;
+		}
+		regionformat = regionformat && hasmanifest;
+		if (k == 0)
+			manifest.regions.swap(filemanifest.regions);
+		else
+			manifest.merge(filemanifest);
+	}
+
+	RenderJob *rjs = new RenderJob[threads];
+	arrayDeleter<RenderJob> adrj(rjs);
+	for (int i = 0; i < threads; i++)
+	{
+		rjs[i].testmode = false;
+		rjs[i].fullrender = fullrender;
+		rjs[i].regionformat = false;
+		rjs[i].mp = mp;
+		rjs[i].outputpath = outputpath;
+	}
+
+	auto_ptr<TileWriter> writer;
+	if (RenderSettings::encoderThreads > 0)
+	{
+		writer.reset(new TileWriter(RenderSettings::encoderThreads));
+		writer->start();
+		for (int i = 0; i < threads; i++)
+			rjs[i].writer = writer.get();
+	}
+
+	cout << "finishing top zoom levels..." << endl;
+	buildTopLevels(rjs, threads, tocache, 0, budget);
+	if (writer.get() != NULL)
+		writer->stop();
+
+	writeHTML(rjs[0], htmlpath);
+	if (regionformat && !manifest.writeFile(outputpath))
+		cerr << "failed to write pigmap.manifest" << endl;
+
+	// the handoff files are used up; a later merge must not find them again
+	for (vector<string>::const_iterator it = files.begin(); it != files.end(); it++)
+		remove(it->c_str());
+
+	cout << "merge finished in " << time(NULL) - tstart << " seconds" << endl;
+	return true;
+}
+
+bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, bool autoincremental, int threads, int testworldsize, bool expand, const string& htmlpath, ShardSpec shard)
 {
 	time_t tstart = time(NULL);
 
 	// prepare the rendering params and the chunk/tile tables
 	// ...note that mp.baseZoom might not be set yet if this is a full render; makeAllChunksRequired
 	//  will handle it
+	// (the tables are declared first, so that they outlive the RenderJob)
+	auto_ptr<ChunkTable> chunktable(new ChunkTable);
+	auto_ptr<TileTable> tiletable(new TileTable);
+	auto_ptr<RegionTable> regiontable(new RegionTable);
+	WorldManifest manifest;  // region headers as of this render, for the next --auto-incremental
 	RenderJob rj;
 	rj.testmode = testworldsize != -1;
 	rj.mp = mp;
@@ -432,9 +729,9 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		cerr << "no block images available; aborting render" << endl;
 		return false;
 	}
-	rj.chunktable.reset(new ChunkTable);
-	rj.tiletable.reset(new TileTable);
-	rj.regiontable.reset(new RegionTable);
+	rj.chunktable = chunktable.get();
+	rj.tiletable = tiletable.get();
+	rj.regiontable = regiontable.get();
 	rj.regionformat = !rj.testmode && detectRegionFormat(rj.inputpath);
 	if (rj.regionformat)
 		cout << "region-format world detected" << endl;
@@ -449,13 +746,13 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		makeTestWorld(testworldsize, *rj.chunktable, *rj.tiletable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount);
 	}
 	// full render
-	else if (chunklist.empty() && regionlist.empty())
+	else if (chunklist.empty() && regionlist.empty() && !autoincremental)
 	{
 		rj.fullrender = true;
 		cout << "scanning world data..." << endl;
 		if (rj.regionformat)
 		{
-			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, manifest))
 				return false;
 		}
 		else
@@ -469,10 +766,22 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	{
 		rj.fullrender = false;
 		int rv;
-		if (rj.regionformat)
+		// the manifest from the last render tells us which chunks have changed; for --auto-incremental, we
+		//  look at every region, for a regionlist, just the listed ones (and the rest of the manifest is kept)
+		WorldManifest previous;
+		if (rj.regionformat && !previous.readFile(rj.outputpath))
+			cout << "no pigmap.manifest in output path; every chunk will be considered changed" << endl;
+		if (!autoincremental)
+			manifest = previous;
+		if (autoincremental)
+		{
+			cout << "looking for changed chunks..." << endl;
+			rv = findChangedChunks(rj.inputpath, previous, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, manifest);
+		}
+		else if (rj.regionformat)
 		{
 			cout << "processing regionlist..." << endl;
-			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount);
+			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, previous, manifest);
 		}
 		else
 		{
@@ -488,12 +797,22 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 				return false;
 			rj.mp.baseZoom++;
 			cout << "baseZoom of output map has been increased to " << rj.mp.baseZoom << endl;
-			rj.chunktable.reset(new ChunkTable);
-			rj.tiletable.reset(new TileTable);
-			rj.regiontable.reset(new RegionTable);
-			if (rj.regionformat)
+			chunktable.reset(new ChunkTable);
+			tiletable.reset(new TileTable);
+			regiontable.reset(new RegionTable);
+			rj.chunktable = chunktable.get();
+			rj.tiletable = tiletable.get();
+			rj.regiontable = regiontable.get();
+			rj.stats.reqchunkcount = 0;
+			if (autoincremental)
 			{
-				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+				manifest.regions.clear();
+				if (0 != findChangedChunks(rj.inputpath, previous, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, manifest))
+					return false;
+			}
+			else if (rj.regionformat)
+			{
+				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, previous, manifest))
 					return false;
 			}
 			else
@@ -504,24 +823,101 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		}
 	}
 
+	// if this is a shard, figure out where the map is divided (now that we know baseZoom), and get rid
+	//  of any old handoff file, so a failure can't leave one behind for the merge
+	if (shard.active())
+	{
+		shard.chooseZoom(rj.mp);
+		if (shard.zoom < 1 || shard.zoom > rj.mp.baseZoom)
+		{
+			cerr << "--shard-zoom must be in range 1-" << rj.mp.baseZoom << " (baseZoom)" << endl;
+			return false;
+		}
+		cout << "rendering shard " << shard.shard + 1 << "/" << shard.numshards << " at zoom level " << shard.zoom << endl;
+		if (!rj.testmode)
+			removeStaleShardFiles(rj.outputpath, shard);
+	}
+
 	if (rj.stats.reqtilecount == 0)
 	{
 		cout << "nothing to do!  (no required tiles)" << endl;
+		// (a shard still has to tell the merge that it's done)
+		if (shard.active() && !rj.testmode && !writeShardFile(rj.outputpath, shard, rj.mp, rj.fullrender, NULL, rj.regionformat ? &manifest : NULL))
+		{
+			cerr << "failed to write " << shardFilePath(rj.outputpath, shard.shard, shard.numshards) << endl;
+			return false;
+		}
 		return true;
 	}
 
+	// if requested, start the encoder threads, so that the render threads can hand off their
+	//  finished tiles instead of compressing and writing them themselves
+	auto_ptr<TileWriter> writer;
+	if (!rj.testmode && RenderSettings::encoderThreads > 0)
+	{
+		writer.reset(new TileWriter(RenderSettings::encoderThreads));
+		writer->start();
+		rj.writer = writer.get();
+	}
+	// likewise for the decoder threads, which help out whenever a region file is read in (so they're no
+	//  use for chunk-format worlds)
+	auto_ptr<ChunkDecoder> decoder;
+	if (!rj.testmode && rj.regionformat && RenderSettings::decoderThreads > 0)
+	{
+		decoder.reset(new ChunkDecoder(RenderSettings::decoderThreads));
+		decoder->start();
+		rj.decoder = decoder.get();
+	}
+
+	// get the tile costs from the last render, if there was one, so the threads can be given equal
+	//  amounts of work
+	TileCostTable costtable;
+	if (!rj.testmode)
+		costtable.readFile(rj.outputpath, rj.mp);
+
 	// render stuff
+	NUMAStats numastart = readNUMAStats();
 	cout << "rendering tiles..." << endl;
-	if (threads >= 2)
-		runMultithreaded(rj, threads);
+	bool rendered = true;
+	if (threads >= 2 || shard.active())
+		rendered = runMultithreaded(rj, threads, costtable, shard, rj.regionformat ? &manifest : NULL);
 	else
 		runSingleThread(rj);
 
+	// wait for the last of the tiles to be written
+	if (writer.get() != NULL)
+	{
+		cout << "waiting for encoder threads..." << endl;
+		TileWriterStats wstats = writer->stop();
+		cout << "encoder threads wrote " << wstats.written << " tiles   " << wstats.failed << " failed   "
+		     << wstats.stalls << " stalls   " << wstats.buffers << " buffers" << endl;
+		rj.writer = NULL;
+	}
+	if (decoder.get() != NULL)
+	{
+		decoder->stop();
+		cout << "decoded " << decoder->chunkcount << " chunks in " << decoder->batchcount << " region batches ("
+		     << decoder->helpercount << " by decoder threads)" << endl;
+		rj.decoder = NULL;
+	}
+	if (!rendered)
+		return false;
+
+	if (RenderSettings::extraStats)
+	{
+		NUMAStats numa = readNUMAStats() - numastart;
+		if (numa.available)
+			cout << "NUMA (" << numa.nodes << " nodes, system-wide): " << numa.hit << " local pages   " << numa.miss << " miss   "
+			     << numa.foreign << " foreign   " << numa.othernode << " other node" << endl;
+		else
+			cout << "NUMA stats not available" << endl;
+	}
+
 	// double-check that all the required tiles were drawn
 	cout << "performing double-check..." << endl;
 	for (RequiredTileIterator it(*rj.tiletable); !it.end; it.advance())
 	{
-		if (!rj.tiletable->isDrawn(it.current))
+		if (!rj.tiletable->isDrawn(it.current) && shard.contains(it.current.toTileIdx(), rj.mp))
 			cerr << "required tile " << it.current.toTileIdx().toFilePath(rj.mp) << " was somehow not drawn!" << endl;
 	}
 
@@ -529,7 +925,18 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	if (!rj.testmode)
 	{
 		rj.mp.writeFile(rj.outputpath);
-		writeHTML(rj, htmlpath);
+		// (the shards would overwrite each other's costs, and the merge will write the HTML)
+		if (!shard.active())
+		{
+			for (vector<TileCostTable::Entry>::const_iterator it = rj.tilecosts.begin(); it != rj.tilecosts.end(); it++)
+				costtable.set(TileIdx(it->x, it->y), it->cost);
+			if (!costtable.writeFile(rj.outputpath, rj.mp))
+				cerr << "failed to write pigmap.costs" << endl;
+			writeHTML(rj, htmlpath);
+		}
+		// (a shard's manifest goes into its handoff file instead; the merge writes the combined one)
+		if (rj.regionformat && !shard.active() && !manifest.writeFile(rj.outputpath))
+			cerr << "failed to write pigmap.manifest" << endl;
 	}
 
 	// done; print stats
@@ -697,6 +1104,58 @@ void testPNG()
 		cout << "PNG test successful" << endl;
 }
 
+// time decompressing all the chunks of a region-format world: with a new zlib stream for each one
+//  (readGzOrZlib), and with a single Inflater
+void benchInflate(const string& inputpath)
+{
+	// pull out the compressed data for every chunk first, so the timing is just the decompression
+	vector<vector<uint8_t> > chunks;
+	vector<string> regionpaths;
+	listEntries(inputpath + "/region", regionpaths);
+	for (vector<string>::const_iterator it = regionpaths.begin(); it != regionpaths.end(); it++)
+	{
+		RegionIdx ri(0,0);
+		RegionFileReader rfr;
+		if (!RegionIdx::fromFilePath(*it, ri) || 0 != rfr.loadFromFile(ri, inputpath))
+			continue;
+		for (RegionChunkIterator cit(ri); !cit.end; cit.advance())
+		{
+			int idx = RegionFileReader::getIdx(cit.current);
+			uint64_t start = (uint64_t)rfr.getSectorOffset(idx) * 4096;
+			if (rfr.offsets[idx] == 0 || start < 4096 || start + 5 > rfr.length)
+				continue;
+			uint32_t datasize = fromBigEndian(*((uint32_t*)(rfr.mapping + start)));
+			if (datasize >= 1 && start + 4 + datasize <= rfr.length)
+				chunks.push_back(vector<uint8_t>(rfr.mapping + start + 5, rfr.mapping + start + 4 + datasize));
+		}
+	}
+	if (chunks.empty())
+	{
+		cout << "no chunks found" << endl;
+		return;
+	}
+
+	const int reps = 20;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		vector<uint8_t> buf;
+		Inflater inflater;
+		int64_t failures = 0, bytes = 0;
+		int64_t start = getMicroseconds();
+		for (int rep = 0; rep < reps; rep++)
+			for (vector<vector<uint8_t> >::iterator it = chunks.begin(); it != chunks.end(); it++)
+			{
+				bool okay = (pass == 0) ? readGzOrZlib(&((*it)[0]), it->size(), buf) : inflater.decompress(&((*it)[0]), it->size(), buf);
+				if (!okay)
+					failures++;
+				bytes += buf.size();
+			}
+		double us = (double)(getMicroseconds() - start) / (double)(reps * chunks.size());
+		cout << (pass == 0 ? "readGzOrZlib: " : "Inflater:     ") << us << " us/chunk   " << bytes / reps << " bytes out   "
+		     << failures / reps << " failures   (" << chunks.size() << " chunks)" << endl;
+	}
+}
+
 struct compareTiles
 {
 	bool operator()(const TileIdx& ti1, const TileIdx& ti2) const {if (ti1.x == ti2.x) return ti1.y < ti2.y; return ti1.x < ti2.x;}
@@ -766,6 +1225,38 @@ void testTileIdxs()
 	}
 }
 
+void testTileChunks()
+{
+	// every chunk whose tile list includes a tile should be in the tile's chunk list, and vice versa
+	for (int T = 1; T <= 4; T++)
+	{
+		MapParams mp(6,T,10);
+		mp.minY = T * 10;
+		mp.maxY = 255 - T * 30;
+		for (int64_t tx = -3; tx <= 3; tx++)
+			for (int64_t ty = -3; ty <= 3; ty++)
+			{
+				TileIdx ti(tx, ty);
+				vector<ChunkIdx> chunks = ti.getChunks(mp);
+				int found = 0;
+				ChunkIdx cibase = ti.baseChunk(mp);
+				for (int64_t cx = cibase.x - 64; cx <= cibase.x + 64; cx++)
+					for (int64_t cz = cibase.z - 64; cz <= cibase.z + 64; cz++)
+					{
+						ChunkIdx ci(cx, cz);
+						vector<TileIdx> tiles = ci.getTiles(mp);
+						if (find(tiles.begin(), tiles.end(), ti) == tiles.end())
+							continue;
+						found++;
+						if (find(chunks.begin(), chunks.end(), ci) == chunks.end())
+							cout << "T = " << T << ": tile [" << tx << "," << ty << "] is missing chunk [" << cx << "," << cz << "]" << endl;
+					}
+				if (found != (int)chunks.size())
+					cout << "T = " << T << ": tile [" << tx << "," << ty << "] has " << chunks.size() << " chunks; expected " << found << endl;
+			}
+	}
+}
+
 void testReqTileCount(const string& inputpath)
 {
 	MapParams mp(6,1,10);
@@ -843,6 +1334,21 @@ bool validateParamsFull(const string& inputpath, const string& outputpath, const
 		cerr << "-t must be in range 1-64" << endl;
 		return false;
 	}
+	if (RenderSettings::prefetchThreads < 0 || RenderSettings::prefetchThreads > 64)
+	{
+		cerr << "-p must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::decoderThreads < 0 || RenderSettings::decoderThreads > 64)
+	{
+		cerr << "-d must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::encoderThreads < 0 || RenderSettings::encoderThreads > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
 
 	// the various paths must be non-empty
 	if (inputpath.empty() || outputpath.empty())
@@ -865,7 +1371,7 @@ bool validateParamsFull(const string& inputpath, const string& outputpath, const
 }
 
 // also sets MapParams to values from existing map
-bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath)
+bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool autoincremental, bool expand, const string& htmlpath)
 {
 	// -B, -T, -Z, -y, -Y are not allowed
 	if (mp.B != -1 || mp.T != -1 || mp.baseZoom != -1 || mp.userMinY || mp.userMaxY)
@@ -899,17 +1405,24 @@ bool validateParamsIncremental(const string& inputpath, const string& outputpath
 		return false;
 	}
 
-	// can't have both chunklist and regionlist
-	if (!chunklist.empty() && !regionlist.empty())
+	// can't have more than one of chunklist, regionlist, and auto-incremental
+	if ((int)!chunklist.empty() + (int)!regionlist.empty() + (int)autoincremental > 1)
 	{
-		cerr << "only one of -c, -r may be used" << endl;
+		cerr << "only one of -c, -r, --auto-incremental may be used" << endl;
 		return false;
 	}
 
-	// if world is in region format, must use regionlist
-	if (detectRegionFormat(inputpath) && regionlist.empty())
+	// if world is in region format, must use regionlist (or find the changes ourselves); the manifest
+	//  only works for regions
+	bool regionformat = detectRegionFormat(inputpath);
+	if (regionformat && !chunklist.empty())
 	{
-		cerr << "world is in region format; must use -r, not -c" << endl;
+		cerr << "world is in region format; must use -r or --auto-incremental, not -c" << endl;
+		return false;
+	}
+	if (!regionformat && autoincremental)
+	{
+		cerr << "--auto-incremental requires a region-format world" << endl;
 		return false;
 	}
 
@@ -927,6 +1440,58 @@ bool validateParamsIncremental(const string& inputpath, const string& outputpath
 		cerr << "-t must be in range 1-64" << endl;
 		return false;
 	}
+	if (RenderSettings::prefetchThreads < 0 || RenderSettings::prefetchThreads > 64)
+	{
+		cerr << "-p must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::decoderThreads < 0 || RenderSettings::decoderThreads > 64)
+	{
+		cerr << "-d must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::encoderThreads < 0 || RenderSettings::encoderThreads > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool validateParamsMerge(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath, int testworldsize, const ShardSpec& shard)
+{
+	// the merge only needs the output path (and the HTML path)
+	if (!inputpath.empty() || !chunklist.empty() || !regionlist.empty() || expand || testworldsize != -1 || shard.active() ||
+	    mp.B != -1 || mp.T != -1 || mp.baseZoom != -1 || mp.userMinY || mp.userMaxY)
+	{
+		cerr << "-i, -c, -r, -x, -w, -B, -T, -Z, -y, -Y, --shard not allowed for --merge" << endl;
+		return false;
+	}
+
+	// must have a sensible number of threads (upper limit is arbitrary, but you'd need a truly
+	//  insanely large map to see any benefit to having that many...)
+	if (threads < 1 || threads > 64)
+	{
+		cerr << "-t must be in range 1-64" << endl;
+		return false;
+	}
+	if (RenderSettings::encoderThreads < 0 || RenderSettings::encoderThreads > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
+
+	if (outputpath.empty())
+	{
+		cerr << "must provide output (-o) path" << endl;
+		return false;
+	}
+	if (htmlpath.empty())
+	{
+		cerr << "must provide non-empty HTML path, or omit -m to use \".\"" << endl;
+		return false;
+	}
 
 	return true;
 }
@@ -969,6 +1534,21 @@ bool validateParamsTest(const string& inputpath, const string& outputpath, const
 		cerr << "-t must be in range 1-64" << endl;
 		return false;
 	}
+	if (RenderSettings::prefetchThreads < 0 || RenderSettings::prefetchThreads > 64)
+	{
+		cerr << "-p must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::decoderThreads < 0 || RenderSettings::decoderThreads > 64)
+	{
+		cerr << "-d must be in range 0-64" << endl;
+		return false;
+	}
+	if (RenderSettings::encoderThreads < 0 || RenderSettings::encoderThreads > 64)
+	{
+		cerr << "-e must be in range 0-64" << endl;
+		return false;
+	}
 
 	// image path must be non-empty
 	if (imgpath.empty())
@@ -987,6 +1567,26 @@ bool validateParamsTest(const string& inputpath, const string& outputpath, const
 	return true;
 }
 
+// parse a byte count, with an optional K/M/G suffix; returns -1 if it can't be parsed
+int64_t parseByteCount(const string& str)
+{
+	istringstream ss(str);
+	int64_t n;
+	if (!(ss >> n) || n < 0)
+		return -1;
+	string suffix;
+	ss >> suffix;
+	if (suffix.empty())
+		return n;
+	if (suffix == "k" || suffix == "K")
+		return n * 1024;
+	if (suffix == "m" || suffix == "M")
+		return n * 1048576;
+	if (suffix == "g" || suffix == "G")
+		return n * 1073741824;
+	return -1;
+}
+
 int main(int argc, char **argv)
 {
 	//testMath();
@@ -1000,7 +1600,12 @@ int main(int argc, char **argv)
 	//testIterators(inputpath);
 	//testZOrder();
 	//testTileIdxs();
+	//testTileChunks();
 	//testReqTileCount(inputpath);
+	//benchInflate(inputpath);
+	//benchExtractBlockIDs();
+	//benchBlockLayouts();
+	//benchSceneGraph();
 	//testResize();
 
 	string inputpath, outputpath, imgpath = ".", chunklist, regionlist, htmlpath = ".";
@@ -1008,9 +1613,24 @@ int main(int argc, char **argv)
 	int threads = 1;
 	int testworldsize = -1;
 	bool expand = false;
+	bool autoincremental = false;
+	ShardSpec shard;
+	bool merge = false;
+
+	// long options (for which there aren't enough sensible letters left)
+	enum {OPT_SHARD = 256, OPT_SHARDZOOM, OPT_MERGE, OPT_AFFINITY, OPT_STATS, OPT_AUTOINCREMENTAL};
+	static const option longopts[] = {
+		{"shard", required_argument, NULL, OPT_SHARD},
+		{"shard-zoom", required_argument, NULL, OPT_SHARDZOOM},
+		{"merge", no_argument, NULL, OPT_MERGE},
+		{"affinity", no_argument, NULL, OPT_AFFINITY},
+		{"stats", no_argument, NULL, OPT_STATS},
+		{"auto-incremental", no_argument, NULL, OPT_AUTOINCREMENTAL},
+		{NULL, 0, NULL, 0}
+	};
 
 	int c;
-	while ((c = getopt(argc, argv, "i:o:g:c:B:T:Z:t:w:xm:r:y:Y:j:f:h")) != -1)
+	while ((c = getopt_long(argc, argv, "i:o:g:c:B:T:Z:t:p:e:d:M:C:R:w:xm:r:y:Y:j:f:h", longopts, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -1070,6 +1690,39 @@ int main(int argc, char **argv)
 			case 't':
 				threads = atoi(optarg);
 				break;
+			case 'p':
+				RenderSettings::prefetchThreads = atoi(optarg);
+				break;
+			case 'e':
+				RenderSettings::encoderThreads = atoi(optarg);
+				break;
+			case 'd':
+				RenderSettings::decoderThreads = atoi(optarg);
+				break;
+			case 'M':
+				RenderSettings::memoryBudget = parseByteCount(optarg);
+				if (RenderSettings::memoryBudget < 0)
+				{
+					cerr << "Invalid memory budget (" << optarg << "), expected bytes with optional K/M/G suffix" << endl;
+					return 1;
+				}
+				break;
+			case 'C':
+				RenderSettings::chunkCacheBudget = parseByteCount(optarg);
+				if (RenderSettings::chunkCacheBudget < 0)
+				{
+					cerr << "Invalid chunk cache size (" << optarg << "), expected bytes with optional K/M/G suffix" << endl;
+					return 1;
+				}
+				break;
+			case 'R':
+				RenderSettings::regionCacheBudget = parseByteCount(optarg);
+				if (RenderSettings::regionCacheBudget <= 0)
+				{
+					cerr << "Invalid region cache size (" << optarg << "), expected bytes with optional K/M/G suffix" << endl;
+					return 1;
+				}
+				break;
 			case 'x':
 				expand = true;
 				break;
@@ -1079,6 +1732,28 @@ int main(int argc, char **argv)
 			case 'w':
 				testworldsize = atoi(optarg);
 				break;
+			case OPT_SHARD:
+				if (!shard.parse(optarg))
+				{
+					cerr << "Invalid shard (" << optarg << "), expected k/N with 1 <= k <= N" << endl;
+					return 1;
+				}
+				break;
+			case OPT_SHARDZOOM:
+				shard.zoom = atoi(optarg);
+				break;
+			case OPT_MERGE:
+				merge = true;
+				break;
+			case OPT_AFFINITY:
+				RenderSettings::pinThreads = true;
+				break;
+			case OPT_STATS:
+				RenderSettings::extraStats = true;
+				break;
+			case OPT_AUTOINCREMENTAL:
+				autoincremental = true;
+				break;
 			case 'h':
 				cerr << "PigMap " << endl
                                      << "-i <path> minecraft world input path. This should be the base of the world" << endl
@@ -1092,12 +1767,24 @@ int main(int argc, char **argv)
                                      << "-y <int> minimum Y value" << endl
                                      << "-Z <int> (base zoom)?" << endl
                                      << "-t <int> threads to use for rendering" << endl
+                                     << "-p <int> extra threads to read chunks ahead of the rendering threads (default 0)" << endl
+                                     << "-e <int> extra threads to compress and write the tile images (default 0)" << endl
+                                     << "-d <int> extra threads to help decode the chunks of each region file as it's read (default 0)" << endl
+                                     << "-M <bytes> memory budget for the tiles passed between threads; K/M/G suffixes allowed (default half of RAM)" << endl
+                                     << "-C <bytes> size of the chunk cache shared by all threads; K/M/G suffixes allowed (default 1024 chunks)" << endl
+                                     << "-R <bytes> size of each thread's region file cache; K/M/G suffixes allowed (default 64M)" << endl
                                      << "-B <int> Block size - size in pixels of each minecraft block (2-16)!" << endl
                                      << "-T <int> Tile Size Division. (2-16)" << endl
                                      << "-Z <int> Map zoom levels (0-30)" << endl
                                      << "-m <path> location of html input files" << endl
                                      << "-x turn on expanding of map, for when base zoom is too small for the tiling" << endl
                                      << "-w <int> turn on test mode, and create test world of size <int>" << endl
+                                     << "--shard k/N render only the k-th of N parts of the map, leaving the top levels for --merge" << endl
+                                     << "--shard-zoom <int> zoom level at which to divide the map into shards (default automatic)" << endl
+                                     << "--merge build the top levels of the map from the parts rendered with --shard" << endl
+                                     << "--auto-incremental redraw the chunks that have changed since the last render (region format only)" << endl
+                                     << "--affinity pin each rendering thread to its own CPU, spread over the NUMA nodes" << endl
+                                     << "--stats print extra statistics (thread placement, NUMA page allocations)" << endl
                                      << endl
                                      << " Tile Size Determines how large the tiles on the map are." << endl 
                                      << " A larger size saves disk space, but makes tiles load slower." << endl;
@@ -1111,23 +1798,48 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (autoincremental && (merge || testworldsize != -1))
+	{
+		cerr << "--auto-incremental can't be used with --merge or -w" << endl;
+		return 1;
+	}
+
+	if (merge)
+	{
+		if (!validateParamsMerge(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, testworldsize, shard))
+			return 1;
+		return performMerge(outputpath, htmlpath, threads) ? 0 : 1;
+	}
+
+	if (shard.zoom != -1 && !shard.active())
+	{
+		cerr << "--shard-zoom requires --shard" << endl;
+		return 1;
+	}
+	// (each shard would expand the shared output path on its own)
+	if (expand && shard.active())
+	{
+		cerr << "-x not allowed with --shard; if the map needs expanding, do an unsharded update with -x first" << endl;
+		return 1;
+	}
+
 	if (testworldsize != -1)
 	{
 		if (!validateParamsTest(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, testworldsize))
 			return 1;
 	}
-	else if (chunklist.empty() && regionlist.empty())
+	else if (chunklist.empty() && regionlist.empty() && !autoincremental)
 	{
 		if (!validateParamsFull(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
 			return 1;
 	}
 	else
 	{
-		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
+		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, autoincremental, expand, htmlpath))
 			return 1;
 	}
 
-	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, threads, testworldsize, expand, htmlpath))
+	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, autoincremental, threads, testworldsize, expand, htmlpath, shard))
 		return 1;
 
 	return 0;
@@ -0,0 +1,187 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <iostream>
+
+#include "prefetch.h"
+#include "utils.h"
+
+using namespace std;
+
+
+
+void PrefetchCursor::startTask(const ZoomTileIdx& zti)
+{
+	mutexLocker ml(prefetcher.mutex);
+	stack.clear();
+	stack.push_back(zti);
+	done = issued = 0;
+	pthread_cond_broadcast(&prefetcher.cond);
+}
+
+void PrefetchCursor::tileStarted()
+{
+	mutexLocker ml(prefetcher.mutex);
+	done++;
+	if (issued - done < PREFETCHTILES)
+		pthread_cond_broadcast(&prefetcher.cond);
+}
+
+
+
+void *runPrefetchThread(void *arg)
+{
+	Prefetcher::Thread *pt = (Prefetcher::Thread*)arg;
+	Prefetcher& pf = *pt->prefetcher;
+	TileIdx ti(-1,-1);
+	while (pf.nextTile(ti))
+	{
+		// if the render thread has already got here (or someone else drew this tile), don't bother
+		if (pf.tiletable.isDrawn(ti))
+			continue;
+		// pull the chunks into the cache; we don't care about the data, just that it's been loaded
+		vector<ChunkIdx> chunks = ti.getChunks(pf.mp);
+		for (vector<ChunkIdx>::const_iterator it = chunks.begin(); it != chunks.end(); it++)
+		{
+			PosChunkIdx ci(*it);
+			if (ci.valid())
+				pt->chunkreader->getData(ci);
+		}
+		pt->tiles++;
+	}
+	return 0;
+}
+
+Prefetcher::Prefetcher(int numthreads, int numcursors, ChunkCache& ccache, ChunkTable& ctable, RegionTable& rtable, const TileTable& ttable,
+                       const MapParams& mparams, const string& inputpath, bool fullrender, bool regionformat, int64_t regioncachebudget,
+                       ChunkDecoder *decoder)
+	: chunkcache(ccache), chunktable(ctable), regiontable(rtable), tiletable(ttable), mp(mparams), stopping(true), nextcursor(0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	for (int i = 0; i < numcursors; i++)
+		cursors.push_back(new PrefetchCursor(*this));
+	for (int i = 0; i < numthreads; i++)
+	{
+		Thread *pt = new Thread;
+		pt->prefetcher = this;
+		pt->tiles = 0;
+		pt->started = false;
+		pt->regioncache.reset(new RegionCache(chunktable, regiontable, inputpath, fullrender, pt->regionstats, regioncachebudget));
+		pt->chunkreader.reset(new ChunkCacheReader(chunkcache, chunktable, regiontable, *pt->regioncache, inputpath, fullrender, regionformat, pt->chunkstats));
+		pt->chunkreader->decoder = decoder;
+		pt->chunkreader->sections = sectionsForYRange(mp);
+		threads.push_back(pt);
+	}
+}
+
+Prefetcher::~Prefetcher()
+{
+	ChunkCacheStats ccstats;
+	RegionCacheStats rcstats;
+	stop(ccstats, rcstats);
+	for (vector<Thread*>::iterator it = threads.begin(); it != threads.end(); it++)
+		delete *it;
+	for (vector<PrefetchCursor*>::iterator it = cursors.begin(); it != cursors.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void Prefetcher::start()
+{
+	stopping = false;
+	for (vector<Thread*>::iterator it = threads.begin(); it != threads.end(); it++)
+	{
+		(*it)->started = 0 == pthread_create(&(*it)->pthr, NULL, runPrefetchThread, (void*)*it);
+		if (!(*it)->started)
+			cerr << "failed to create prefetch thread!" << endl;
+	}
+}
+
+int64_t Prefetcher::stop(ChunkCacheStats& ccstats, RegionCacheStats& rcstats)
+{
+	{
+		mutexLocker ml(mutex);
+		stopping = true;
+		pthread_cond_broadcast(&cond);
+	}
+	int64_t tiles = 0;
+	for (vector<Thread*>::iterator it = threads.begin(); it != threads.end(); it++)
+	{
+		if ((*it)->started)
+			pthread_join((*it)->pthr, NULL);
+		(*it)->started = false;
+		// the readers still hold pins in the ChunkCache; drop them now, while the cache is still around
+		(*it)->chunkreader.reset();
+		ccstats += (*it)->chunkstats;
+		rcstats += (*it)->regionstats;
+		tiles += (*it)->tiles;
+		(*it)->chunkstats = ChunkCacheStats();
+		(*it)->regionstats = RegionCacheStats();
+		(*it)->tiles = 0;
+	}
+	return tiles;
+}
+
+bool Prefetcher::nextTile(TileIdx& ti)
+{
+	mutexLocker ml(mutex);
+	while (!stopping)
+	{
+		// find a render thread that isn't far enough ahead yet, starting after the last one we helped
+		for (int i = 0; i < (int)cursors.size(); i++)
+		{
+			int c = (nextcursor + i) % cursors.size();
+			PrefetchCursor& pc = *cursors[c];
+			if (pc.issued - pc.done < PREFETCHTILES && advanceCursor(pc, ti))
+			{
+				nextcursor = (c + 1) % cursors.size();
+				return true;
+			}
+		}
+		pthread_cond_wait(&cond, &mutex);
+	}
+	return false;
+}
+
+bool Prefetcher::advanceCursor(PrefetchCursor& pc, TileIdx& ti)
+{
+	// walk the zoom tile's subtiles depth-first, in the same order as renderZoomTile, skipping
+	//  any base tiles that the render thread has already passed
+	while (!pc.stack.empty())
+	{
+		ZoomTileIdx zti = pc.stack.back();
+		pc.stack.pop_back();
+		if (zti.zoom == mp.baseZoom)
+		{
+			ti = zti.toTileIdx(mp);
+			if (!tiletable.isRequired(ti))
+				continue;
+			pc.issued++;
+			if (pc.issued <= pc.done)
+				continue;
+			return true;
+		}
+		if (tiletable.reject(zti, mp))
+			continue;
+		ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
+		pc.stack.push_back(topleft.add(1,1));
+		pc.stack.push_back(topleft.add(1,0));
+		pc.stack.push_back(topleft.add(0,1));
+		pc.stack.push_back(topleft);
+	}
+	return false;
+}
@@ -0,0 +1,106 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "tables.h"
+#include "region.h"
+#include "chunk.h"
+
+
+#define PREFETCHTILES 2  // how many base tiles to stay ahead of each render thread
+
+
+struct Prefetcher;
+struct ChunkDecoder;
+
+// follows a single render thread through the base tiles of its current zoom tile, in the order they
+//  will be rendered (the same order as renderZoomTile's recursion)
+struct PrefetchCursor
+{
+	Prefetcher& prefetcher;
+	std::vector<ZoomTileIdx> stack;  // zoom tiles still to be visited; next one on the back
+	int64_t done;  // base tiles the render thread has started on in its current zoom tile
+	int64_t issued;  // base tiles whose chunks have been (or are being) loaded
+
+	PrefetchCursor(Prefetcher& pf) : prefetcher(pf), done(0), issued(0) {}
+
+	// called by the render thread when it starts on a new zoom tile, and after each base tile
+	void startTask(const ZoomTileIdx& zti);
+	void tileStarted();
+};
+
+// a small pool of threads that read and decode the chunks that the render threads are about to need,
+//  so that the chunks are already in the ChunkCache when the render threads get to them
+struct Prefetcher : private nocopy
+{
+	struct Thread
+	{
+		Prefetcher *prefetcher;
+		pthread_t pthr;
+		bool started;
+		ChunkCacheStats chunkstats;
+		RegionCacheStats regionstats;
+		std::auto_ptr<RegionCache> regioncache;
+		std::auto_ptr<ChunkCacheReader> chunkreader;
+		int64_t tiles;  // base tiles prefetched
+	};
+
+	ChunkCache& chunkcache;
+	ChunkTable& chunktable;
+	RegionTable& regiontable;
+	const TileTable& tiletable;
+	MapParams mp;
+
+	std::vector<PrefetchCursor*> cursors;
+	std::vector<Thread*> threads;
+
+	// protects the cursors; the prefetch threads wait on the condition when all the cursors are far
+	//  enough ahead
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool stopping;
+	int nextcursor;  // where to start looking for work, so the render threads get served in turn
+
+	// (each thread gets its own RegionCache with the given budget; the readers hand newly read regions to
+	//  the decoder, if there is one)
+	Prefetcher(int numthreads, int numcursors, ChunkCache& ccache, ChunkTable& ctable, RegionTable& rtable, const TileTable& ttable,
+	           const MapParams& mparams, const std::string& inputpath, bool fullrender, bool regionformat, int64_t regioncachebudget,
+	           ChunkDecoder *decoder = NULL);
+	~Prefetcher();  // stops the threads, if they're still running
+
+	// start the threads running
+	void start();
+	// stop the threads, and add their stats into the supplied ones; returns the number of base tiles
+	//  that were prefetched
+	int64_t stop(ChunkCacheStats& ccstats, RegionCacheStats& rcstats);
+
+	// get the next base tile to prefetch; blocks until there is one, or returns false when stopping
+	bool nextTile(TileIdx& ti);
+
+	// advance a cursor to its next required base tile, if it has one
+	bool advanceCursor(PrefetchCursor& pc, TileIdx& ti);
+};
+
+
+#endif // PREFETCH_H
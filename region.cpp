@@ -18,6 +18,16 @@
 #include <stdio.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+#include <algorithm>
 
 #include "region.h"
 #include "utils.h"
@@ -47,39 +57,121 @@ FILE* openRegionFile(const RegionIdx& ri, const string& inputpath, bool& anvil)
 	return fopen(filename.c_str(), "rb");
 }
 
-int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
+// a mapped region file can be truncated by whoever is writing it (e.g. Minecraft, when rendering a live
+//  world), and touching a mapped page beyond the new end of the file raises SIGBUS rather than returning
+//  an error; so chunks are copied out of the mapping with a handler armed that jumps back out of the copy,
+//  and the chunk is treated as corrupt (it will be redrawn next time anyway, since it's changed)
+// ...only a plain memcpy runs under the guard, so the jump never skips any destructors
+static __thread sigjmp_buf * volatile sigbusjump = NULL;  // set while this thread is copying from a mapping
+static pthread_once_t sigbusonce = PTHREAD_ONCE_INIT;
+
+static void sigbusHandler(int sig)
+{
+	if (sigbusjump != NULL)
+		siglongjmp(*sigbusjump, 1);
+	// not from one of our copies; die as we would have without the handler
+	signal(SIGBUS, SIG_DFL);
+	raise(SIGBUS);
+}
+
+static void installSigbusHandler()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigbusHandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+}
+
+// copy from a mapping; returns false if the file turned out to be shorter than the mapping
+static bool copyFromMapping(uint8_t *dest, const uint8_t *src, size_t size)
+{
+	sigjmp_buf env;
+	if (sigsetjmp(env, 1) != 0)
+	{
+		sigbusjump = NULL;
+		return false;
+	}
+	sigbusjump = &env;
+	memcpy(dest, src, size);
+	sigbusjump = NULL;
+	return true;
+}
+
+void RegionFileReader::closeFile()
+{
+	if (mapping != NULL)
+		munmap(mapping, length);
+	if (fd != -1)
+		close(fd);
+	mapping = NULL;
+	fd = -1;
+	length = 0;
+}
+
+int RegionFileReader::openFile(const RegionIdx& ri, const string& inputpath)
 {
+	closeFile();
+
 	// open file
-	FILE *f = openRegionFile(ri, inputpath, anvil);
-	if (f == NULL)
-		return -1;
-	fcloser fc(f);
+	anvil = true;
+	fd = open((inputpath + "/region/" + ri.toAnvilFileName()).c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		anvil = false;
+		fd = open((inputpath + "/region/" + ri.toOldFileName()).c_str(), O_RDONLY);
+		if (fd == -1)
+			return -1;
+	}
 
 	// get file length
-	fseek(f, 0, SEEK_END);
-	size_t length = (size_t)ftell(f);
-	fseek(f, 0, SEEK_SET);
-	if (length < 4096)
+	struct stat st;
+	if (0 != fstat(fd, &st) || st.st_size < 4096)
+	{
+		closeFile();
 		return -2;
+	}
+	length = (size_t)st.st_size;
 
 	// read the header
-	size_t count = fread(&(offsets[0]), 4096, 1, f);
-	if (count < 1)
+	if (pread(fd, &(offsets[0]), 4096, 0) != 4096)
+	{
+		closeFile();
 		return -2;
+	}
+	return 0;
+}
 
-	// read the rest of the file
-	chunkdata.resize(length - 4096);
-	if (length > 4096)
+int RegionFileReader::mapFile()
+{
+	// map the whole thing (the mapping outlives the file handle); we'll want most of it, so have the
+	//  kernel read it all in now, in order
+	void *m = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED)
 	{
-		count = fread(&(chunkdata[0]), length - 4096, 1, f);
-		if (count < 1)
-			return -2;
+		closeFile();
+		return -2;
 	}
+	pthread_once(&sigbusonce, installSigbusHandler);
+	mapping = (uint8_t*)m;
+	madvise(mapping, length, MADV_WILLNEED);
+	close(fd);
+	fd = -1;
 	return 0;
 }
 
+int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
+{
+	int result = openFile(ri, inputpath);
+	if (result != 0)
+		return result;
+	return mapFile();
+}
+
 int RegionFileReader::loadHeaderOnly(const RegionIdx& ri, const string& inputpath)
 {
+	closeFile();
+
 	// open file
 	FILE *f = openRegionFile(ri, inputpath, anvil);
 	if (f == NULL)
@@ -90,24 +182,47 @@ int RegionFileReader::loadHeaderOnly(const RegionIdx& ri, const string& inputpat
 	size_t count = fread(&(offsets[0]), 4096, 1, f);
 	if (count < 1)
 		return -2;
+	count = fread(&(timestamps[0]), 4096, 1, f);
+	if (count < 1)
+		fill(timestamps.begin(), timestamps.end(), 0);
 
 	return 0;
 }
 
-int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& buf)
+int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& buf, vector<uint8_t>& sectorbuf,
+                                      Inflater& inflater) const
 {
 	// see if chunk is present
 	if (!containsChunk(co))
 		return -1;
+	if (mapping == NULL && fd == -1)
+		return -2;
 
-	// attempt to decompress chunk data into buffer
+	// make sure the chunk's data (including its length field) is actually inside the file; the
+	//  first sector is the header, so no chunk can start there
 	int idx = getIdx(co);
-	uint32_t sector = getSectorOffset(idx);
-	if ((sector - 1) * 4096 >= chunkdata.size())
+	uint64_t start = (uint64_t)getSectorOffset(idx) * 4096;
+	if (start < 4096 || start + 5 > length)
+		return -2;
+
+	// get the chunk's sectors (or as much of them as the file has), either from the mapping (see
+	//  copyFromMapping) or straight from the file
+	size_t size = min((uint64_t)getSizeSectors(idx) * 4096, length - start);
+	sectorbuf.resize(max(size, (size_t)5));
+	if (mapping != NULL)
+	{
+		if (!copyFromMapping(&(sectorbuf[0]), mapping + start, size))
+			return -2;
+	}
+	else if (pread(fd, &(sectorbuf[0]), size, start) != (ssize_t)size)
 		return -2;
-	uint8_t *chunkstart = &(chunkdata[(sector - 1) * 4096]);
+	uint8_t *chunkstart = &(sectorbuf[0]);
 	uint32_t datasize = fromBigEndian(*((uint32_t*)chunkstart));
-	bool okay = readGzOrZlib(chunkstart + 5, datasize - 1, buf);
+	if (datasize < 1 || start + 4 + datasize > length || 4 + datasize > sectorbuf.size())
+		return -2;
+
+	// attempt to decompress chunk data into buffer
+	bool okay = inflater.decompress(chunkstart + 5, datasize - 1, buf);
 	if (!okay)
 		return -2;
 	return 0;
@@ -157,66 +272,60 @@ RegionCacheStats& RegionCacheStats::operator+=(const RegionCacheStats& rcs)
 	missing += rcs.missing;
 	reqmissing += rcs.reqmissing;
 	corrupt += rcs.corrupt;
+	reread += rcs.reread;
+	partial += rcs.partial;
 	return *this;
 }
 
 
+RegionCache::~RegionCache()
+{
+	for (map<int64_t, RegionCacheEntry*>::iterator it = entries.begin(); it != entries.end(); it++)
+		delete it->second;
+}
+
 int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& buf, bool& anvil)
 {
 	PosRegionIdx ri = ci.toChunkIdx().getRegionIdx();
-	int e = getEntryNum(ri);
-	int state = regiontable.getDiskState(ri);
-	
-	if (state == RegionSet::REGION_UNKNOWN)
-		stats.misses++;
-	else
+	fresh = NULL;
+
+	// if the region is in the cache, try to extract the chunk from it
+	map<int64_t, RegionCacheEntry*>::iterator it = entries.find(getKey(ri));
+	if (it != entries.end())
+	{
 		stats.hits++;
-	
-	// if we already tried and failed to read this region, don't try again
+		it->second->lastuse = ++tick;
+		anvil = it->second->regionfile.anvil;
+		return it->second->regionfile.decompressChunk(ci.toChunkIdx(), buf, sectorbuf, inflater);
+	}
+
+	// if we (or another thread) already tried and failed to read this region, don't try again
+	// (the chunk's own disk state will normally have caught this already, but another thread may have
+	//  marked the region just after we checked)
+	int state = regiontable.getDiskState(ri);
 	if (state == RegionSet::REGION_CORRUPTED || state == RegionSet::REGION_MISSING)
 	{
-		// actually, it shouldn't even be possible to get here, since the disk state
-		//  flags for all chunks in the region should have been set the first time we failed
-		cerr << "cache invariant failure!  tried to read already-failed region" << endl;
+		stats.hits++;
 		return -1;
 	}
-	
-	// if the region is in the cache, try to extract the chunk from it
-	if (state == RegionSet::REGION_CACHED)
-	{
-		// try the "real" cache entry, then the extra readbuf
-		if (entries[e].ri == ri)
-		{
-			anvil = entries[e].regionfile.anvil;
-			return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
-		}
-		else if (readbuf.ri == ri)
-		{
-			anvil = readbuf.regionfile.anvil;
-			return readbuf.regionfile.decompressChunk(ci.toChunkIdx(), buf);
-		}
-		// if it wasn't in one of those two places, it shouldn't have been marked as cached
-		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]   [" << readbuf.ri.x << "," << readbuf.ri.z << "]" << endl;
-		exit(-1);
-	}
+	stats.misses++;
 
 	// if this is a full render and the region is not required, we already know it doesn't exist
 	bool req = regiontable.isRequired(ri);
 	if (fullrender && !req)
 	{
 		stats.skipped++;
-		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
 		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
 			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
+		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
 		return -1;
 	}
 	
 	// okay, we actually have to read the region from disk, if it's there
-	readRegionFile(ri);
+	RegionCacheEntry *entry;
+	state = readRegionFile(ri, entry);
 	
 	// check whether the read succeeded; try to extract the chunk if so
-	state = regiontable.getDiskState(ri);
 	if (state == RegionSet::REGION_CORRUPTED)
 	{
 		stats.corrupt++;
@@ -230,47 +339,74 @@ int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& bu
 			stats.missing++;
 		return -1;
 	}
-	// since we've actually just done a read, the region should now be in a real cache entry, not the readbuf
-	if (state != RegionSet::REGION_CACHED || entries[e].ri != ri)
-	{
-		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]" << endl;
-		exit(-1);
-	}
 	stats.read++;
-	anvil = entries[e].regionfile.anvil;
-	return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
+	fresh = entry;
+	anvil = entry->regionfile.anvil;
+	return entry->regionfile.decompressChunk(ci.toChunkIdx(), buf, sectorbuf, inflater);
 }
 
-void RegionCache::readRegionFile(const PosRegionIdx& ri)
+int RegionCache::readRegionFile(const PosRegionIdx& ri, RegionCacheEntry*& entry)
 {
-	// forget the data in the readbuf
-	if (readbuf.ri.valid())
-		regiontable.setDiskState(readbuf.ri, RegionSet::REGION_UNKNOWN);
-	readbuf.ri = PosRegionIdx(-1,-1);
-	
 	// read the region file from disk, if it's there
-	int result = readbuf.regionfile.loadFromFile(ri.toRegionIdx(), inputpath);
+	// (on failure, mark the chunks before the region itself, so that anyone who sees the region's state
+	//  will also see the chunks')
+	auto_ptr<RegionCacheEntry> newentry(new RegionCacheEntry(ri));
+	int result = newentry->regionfile.openFile(ri.toRegionIdx(), inputpath);
+	if (result == 0)
+	{
+		if (wantWholeFile(ri, newentry->regionfile))
+			result = newentry->regionfile.mapFile();
+		else
+			stats.partial++;
+	}
 	if (result == -1)
 	{
-		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
 		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
 			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return;
+		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
+		return RegionSet::REGION_MISSING;
 	}
 	if (result == -2)
 	{
-		regiontable.setDiskState(ri, RegionSet::REGION_CORRUPTED);
 		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
 			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return;
+		regiontable.setDiskState(ri, RegionSet::REGION_CORRUPTED);
+		return RegionSet::REGION_CORRUPTED;
 	}
 	
-	// read was successful; evict current tenant of chunk's cache slot (swap it into the readbuf)
-	int e = getEntryNum(ri);
-	entries[e].regionfile.swap(readbuf.regionfile);
-	swap(entries[e].ri, readbuf.ri);
-	// mark the entry as vaild and the region as cached
-	entries[e].ri = ri;
-	regiontable.setDiskState(ri, RegionSet::REGION_CACHED);
+	// read was successful; add the new entry, and make room for it if necessary
+	int64_t key = getKey(ri);
+	if (!readbefore.insert(key).second)
+		stats.reread++;
+	entry = newentry.release();
+	entry->lastuse = ++tick;
+	entries[key] = entry;
+	cached += getCost(entry);
+	evict();
+	return RegionSet::REGION_CACHED;
+}
+
+bool RegionCache::wantWholeFile(const PosRegionIdx& ri, const RegionFileReader& regionfile) const
+{
+	// add up the sectors of the chunks that we know will be drawn (we may need a few more from the edges
+	//  of the region, too)
+	int64_t needed = 0;
+	for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
+		if (chunktable.isRequired(it.current))
+			needed += regionfile.getSizeSectors(RegionFileReader::getIdx(it.current));
+	return needed * RCACHEREADALL >= (int64_t)(regionfile.length / 4096);
+}
+
+void RegionCache::evict()
+{
+	while (cached > budget && entries.size() > 1)
+	{
+		map<int64_t, RegionCacheEntry*>::iterator victim = entries.begin();
+		for (map<int64_t, RegionCacheEntry*>::iterator it = entries.begin(); it != entries.end(); it++)
+			if (it->second->lastuse < victim->second->lastuse)
+				victim = it;
+		cached -= getCost(victim->second);
+		delete victim->second;
+		entries.erase(victim);
+	}
 }
@@ -19,9 +19,12 @@
 #define REGION_H
 
 #include <stdint.h>
+#include <map>
+#include <set>
 
 #include "map.h"
 #include "tables.h"
+#include "utils.h"
 
 
 // offset into a region of a chunk
@@ -42,55 +45,69 @@ struct string84
 	explicit string84(const std::string& sss) : s(sss) {}
 };
 
-struct RegionFileReader
+struct RegionFileReader : private nocopy
 {
 	// region file is broken into 4096-byte sectors; first sector is the header that holds the
 	//  chunk offsets, remaining sectors are chunk data
 
 	// chunk offsets are big-endian; lower (that is, 4th) byte is size in sectors, upper 3 bytes are
-	//  sector offset *in region file* (one more than the offset into chunkdata)
+	//  sector offset in region file
 	// offsets are indexed by Z*32 + X
 	std::vector<uint32_t> offsets;
+	// the second sector holds the last modification time of each chunk (big-endian Unix times, indexed
+	//  like the offsets); these are only read by loadHeaderOnly
+	std::vector<uint32_t> timestamps;
 	// each set of chunk data contains:
 	//  -a 4-byte big-endian data length (not including the length field itself)
 	//  -a single-byte version: 1 for gzip, 2 for zlib (this byte *is* included in the length)
 	//  -length - 1 bytes of actual compressed data
-	std::vector<uint8_t> chunkdata;
+	// ...the chunk data is read in one of two ways: either the whole file is mapped into memory (read-only),
+	//  or it's left open, and the sectors of each chunk are read as they're needed; either way, each
+	//  chunk's sectors are copied into a buffer supplied by the caller before decompressing (from a
+	//  mapping, under a SIGBUS guard, in case the file is truncated while we have it mapped), so several
+	//  threads can decompress chunks from the same reader at once
+	uint8_t *mapping;  // NULL if nothing is mapped
+	int fd;  // -1 if the file isn't open (it's closed once it's been mapped)
+	size_t length;  // of the whole file
 	// whether this data was read from an Anvil region file or an old-style one
 	bool anvil;
 
-	RegionFileReader()
+	RegionFileReader() : mapping(NULL), fd(-1), length(0), anvil(false)
 	{
 		offsets.resize(32 * 32);
-		chunkdata.reserve(8388608);
-	}
-	
-	void swap(RegionFileReader& rfr)
-	{
-		offsets.swap(rfr.offsets);
-		chunkdata.swap(rfr.chunkdata);
-		std::swap(anvil, rfr.anvil);
+		timestamps.resize(32 * 32);
 	}
+	~RegionFileReader() {closeFile();}
+
+	// let go of the current file (and its mapping), if any
+	void closeFile();
 
 	// extract values from the offsets
 	static int getIdx(const ChunkOffset& co) {return co.z*32 + co.x;}
 	uint32_t getSizeSectors(int idx) const {return fromBigEndian(offsets[idx]) & 0xff;}
 	uint32_t getSectorOffset(int idx) const {return fromBigEndian(offsets[idx]) >> 8;}
-	bool containsChunk(const ChunkOffset& co) {return offsets[getIdx(co)] != 0;}
+	bool containsChunk(const ChunkOffset& co) const {return offsets[getIdx(co)] != 0;}
 
 
-	// attempt to read a region file; return 0 for success, -1 for file not found, -2 for
-	//  other errors
+	// attempt to open a region file and read its header, leaving it open so chunks can be read from it
+	//  individually; return 0 for success, -1 for file not found, -2 for other errors
 	// looks for an Anvil region file (.mca) first, then an old-style one (.mcr)
+	int openFile(const RegionIdx& ri, const std::string& inputpath);
+	// after openFile, map the whole file and have the kernel start reading it in; return 0 for success,
+	//  -2 for errors
+	int mapFile();
+	// openFile followed by mapFile
 	int loadFromFile(const RegionIdx& ri, const std::string& inputpath);
 
 	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
 	//  -2 for other errors
-	// (this is not const only because zlib won't take const pointers for input)
-	int decompressChunk(const ChunkOffset& co, std::vector<uint8_t>& buf);
+	// ...sectorbuf is scratch space for the compressed data, and belongs to the caller, like buf and inflater
+	int decompressChunk(const ChunkOffset& co, std::vector<uint8_t>& buf, std::vector<uint8_t>& sectorbuf,
+	                    Inflater& inflater) const;
 
-	// attempt to read only the header (i.e. the chunk offsets) from a region file; return 0
+	// attempt to read only the header (i.e. the chunk offsets and timestamps) from a region file; return 0
 	//  for success, -1 for file not found, -2 for other errors
+	// (a file too short to have timestamps gets all zeroes)
 	// looks for an Anvil region file (.mca) first, then an old-style one (.mcr)
 	int loadHeaderOnly(const RegionIdx& ri, const std::string& inputpath);
 
@@ -125,54 +142,75 @@ struct RegionCacheStats
 	int64_t missing;  // non-required region not present on disk
 	int64_t reqmissing;  // required region not present on disk
 	int64_t corrupt;  // found on disk, but failed to read
+	int64_t reread;  // reads of regions that had been read before, but were evicted since
+	int64_t partial;  // reads that only fetch the needed chunks from the file, rather than the whole thing
 
-	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0), reread(0), partial(0) {}
 
 	RegionCacheStats& operator+=(const RegionCacheStats& rs);
 };
 
-struct RegionCacheEntry
+struct RegionCacheEntry : private nocopy
 {
-	PosRegionIdx ri;  // or [-1, -1] if this entry is empty
+	PosRegionIdx ri;
 	RegionFileReader regionfile;
+	int64_t lastuse;  // cache tick of the most recent lookup, for choosing eviction victims
 	
-	RegionCacheEntry() : ri(-1,-1) {}
+	RegionCacheEntry(const PosRegionIdx& r) : ri(r), lastuse(0) {}
 };
 
-#define RCACHEBITSX 1
-#define RCACHEBITSZ 1
-#define RCACHEXSIZE (1 << RCACHEBITSX)
-#define RCACHEZSIZE (1 << RCACHEBITSZ)
-#define RCACHESIZE (RCACHEXSIZE * RCACHEZSIZE)
-#define RCACHEXMASK (RCACHEXSIZE - 1)
-#define RCACHEZMASK (RCACHEZSIZE - 1)
+#define RCACHEBUDGET 67108864  // default bytes of region files held by each RegionCache
+#define RCACHEREADALL 4  // read whole region files when the required chunks take up at least 1/this of them
+#define RCACHEPARTIALCOST 262144  // charged against the budget for a region file that's open but not mapped
+                                  //  (it holds only the header and a file handle, but those aren't unlimited)
 
+// each thread has its own cache of region files; they're evicted least recently used first, once the
+//  total size of the mapped files (plus RCACHEPARTIALCOST for each unmapped one) goes over the budget
+//  (though the most recent one is always kept)
+// ...since the files are mapped rather than read, the memory actually used is whatever parts of them
+//  the kernel has paged in
 struct RegionCache : private nocopy
 {
-	RegionCacheEntry entries[RCACHESIZE];
+	std::map<int64_t, RegionCacheEntry*> entries;  // keyed by getKey()
+	int64_t budget;  // bytes
+	int64_t cached;  // total cost of the entries (see getCost)
+	int64_t tick;
+	std::set<int64_t> readbefore;  // regions we've read at some point, to spot re-reads
+	Inflater inflater;  // for all the chunks we decompress
+	std::vector<uint8_t> sectorbuf;  // and for reading their compressed data into
+	RegionCacheEntry *fresh;  // set if the last getDecompressedChunk had to read the region in (else NULL)
 
 	ChunkTable& chunktable;
 	RegionTable& regiontable;
 	RegionCacheStats& stats;
 	std::string inputpath;
 	bool fullrender;
-	// readbuf is an extra less-important cache entry--when a new region is read, it's this entry which will be trashed
-	//  and its storage used for the read (which might fail), but if the read succeeds, the new region is swapped
-	//  into its proper place in the cache, and the previous tenant there moves here
-	RegionCacheEntry readbuf;
-	RegionCache(ChunkTable& ctable, RegionTable& rtable, const std::string& inpath, bool fullr, RegionCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), stats(st), inputpath(inpath), fullrender(fullr)
+	RegionCache(ChunkTable& ctable, RegionTable& rtable, const std::string& inpath, bool fullr, RegionCacheStats& st, int64_t budg = RCACHEBUDGET)
+		: budget(budg), cached(0), tick(0), fresh(NULL), chunktable(ctable), regiontable(rtable), stats(st), inputpath(inpath), fullrender(fullr)
 	{
 	}
+	~RegionCache();
 
 	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
 	//  -2 for other errors
 	// (this is not const only because zlib won't take const pointers for input)
 	int getDecompressedChunk(const PosChunkIdx& ci, std::vector<uint8_t>& buf, bool& anvil);
 
-	static int getEntryNum(const PosRegionIdx& ri) {return (ri.x & RCACHEXMASK) * RCACHEZSIZE + (ri.z & RCACHEZMASK);}
+	static int64_t getKey(const PosRegionIdx& ri) {return ri.x * RTTOTALSIZE + ri.z;}
+	// what an entry counts for against the budget
+	static int64_t getCost(const RegionCacheEntry *entry)
+	{
+		return (entry->regionfile.mapping != NULL) ? (int64_t)entry->regionfile.length : RCACHEPARTIALCOST;
+	}
+
+	// read a region into the cache; return the resulting disk state (REGION_CACHED for success), and
+	//  the new entry if successful
+	int readRegionFile(const PosRegionIdx& ri, RegionCacheEntry*& entry);
+	// whether it's worth reading an entire region file, rather than just the chunks we'll need from it
+	bool wantWholeFile(const PosRegionIdx& ri, const RegionFileReader& regionfile) const;
 
-	void readRegionFile(const PosRegionIdx& ri);
+	// throw out the least recently used entries until we're within budget (but keep at least one)
+	void evict();
 };
 
 
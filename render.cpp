@@ -18,13 +18,31 @@
 #include <memory>
 #include <iostream>
 #include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "render.h"
+#include "prefetch.h"
+#include "writer.h"
 #include "utils.h"
 
 using namespace std;
 
 
+namespace RenderSettings
+{
+
+	int prefetchThreads = 0;
+	int encoderThreads = 0;
+	int decoderThreads = 0;
+	int64_t memoryBudget = 0;
+	int64_t chunkCacheBudget = 0;
+	int64_t regionCacheBudget = RCACHEBUDGET;
+	bool pinThreads = false;
+	bool extraStats = false;
+
+}
+
 
 int ThreadOutputCache::getIndex(const ZoomTileIdx& zti) const
 {
@@ -33,8 +51,99 @@ int ThreadOutputCache::getIndex(const ZoomTileIdx& zti) const
 	return zti.y * (1 << zoom) + zti.x;
 }
 
+ThreadOutputCache::ThreadOutputCache(int z, int64_t budg, const string& spilldir)
+	: zoom(z), images((1 << zoom) * (1 << zoom)), used((1 << zoom) * (1 << zoom), 0), budget(budg), inmemory(0),
+	  spilled((1 << zoom) * (1 << zoom), -1), spillfd(-1), spillend(0), spillfailed(0)
+{
+	// (mkstemp picks a unique name, so other pigmap processes sharing the spill directory--e.g. the
+	//  shards of one render--can't collide with us)
+	if (!spilldir.empty())
+		spillpath = spilldir + "/pigmap-spill-XXXXXX";
+	pthread_mutex_init(&spillmutex, NULL);
+}
 
+ThreadOutputCache::~ThreadOutputCache()
+{
+	if (spillfd != -1)
+		close(spillfd);
+	pthread_mutex_destroy(&spillmutex);
+}
 
+void ThreadOutputCache::store(int idx, bool u)
+{
+	used[idx] = u;
+	RGBAImage& img = images[idx];
+	// if this tile turned out to be empty, we don't need its memory
+	if (!u)
+	{
+		vector<RGBAPixel>().swap(img.data);
+		return;
+	}
+	int64_t bytes = img.data.size() * sizeof(RGBAPixel);
+	if (budget == 0 || bytes == 0 || __sync_add_and_fetch(&inmemory, bytes) <= budget || spillpath.empty() ||
+	    __sync_add_and_fetch(&spillfailed, 0))
+		return;
+	__sync_sub_and_fetch(&inmemory, bytes);
+
+	// we're over budget, so write this one out
+	{
+		mutexLocker ml(spillmutex);
+		// (another thread may have failed to create the file since we checked)
+		if (spillfailed)
+		{
+			__sync_add_and_fetch(&inmemory, bytes);
+			return;
+		}
+		if (spillfd == -1)
+		{
+			makePath(spillpath.substr(0, spillpath.rfind('/')));
+			vector<char> name(spillpath.begin(), spillpath.end());
+			name.push_back('\0');
+			spillfd = mkstemp(&name[0]);
+			if (spillfd == -1)
+			{
+				cerr << "failed to create spill file " << spillpath << "; keeping tiles in memory" << endl;
+				__sync_add_and_fetch(&spillfailed, 1);
+				__sync_add_and_fetch(&inmemory, bytes);
+				return;
+			}
+			// the file goes away on its own once it's closed
+			unlink(&name[0]);
+		}
+	}
+	int64_t offset = __sync_fetch_and_add(&spillend, bytes);
+	if (pwrite(spillfd, &img.data[0], bytes, offset) != bytes)
+	{
+		cerr << "failed to write to spill file; keeping tile in memory" << endl;
+		__sync_add_and_fetch(&inmemory, bytes);
+		return;
+	}
+	spilled[idx] = offset;
+	vector<RGBAPixel>().swap(img.data);
+}
+
+const RGBAImage* ThreadOutputCache::getImage(int idx, RGBAImage& buf) const
+{
+	if (spilled[idx] == -1)
+		return &images[idx];
+	buf.create(images[idx].w, images[idx].h);
+	int64_t bytes = buf.data.size() * sizeof(RGBAPixel);
+	if (pread(spillfd, &buf.data[0], bytes, spilled[idx]) != bytes)
+		return NULL;
+	return &buf;
+}
+
+
+
+
+// write a finished tile to disk, or hand it to the encoder threads to do so
+void writeTile(RenderJob& rj, RGBAImage& tile, const string& tilefile)
+{
+	if (rj.writer != NULL)
+		rj.writer->write(tile, tilefile);
+	else if (!tile.writeImage(tilefile))
+		cerr << "failed to write " << tilefile << endl;
+}
 
 // get topmost y-coord in a column (even if column is out-of-bounds--only looks at top edge of bbox)
 int64_t topPixelY(int64_t x, int64_t bboxTop, int B)
@@ -131,7 +240,57 @@ void PseudocolumnIterator::advance()
 		end = true;
 }
 
+void PseudocolumnIterator::advance(int64_t steps)
+{
+	current += BlockIdx(steps, -steps, -steps);
+	if (current.y < mparams.minY)
+		end = true;
+}
+
+
+
+int SceneGraph::addNode(const SceneGraphNode& node)
+{
+	int n = infos.size();
+	if (n == 0)
+		origin = node.bi;
+	infos.push_back(node.bimgoffset | (node.darkenEU ? DARKEN_EU : 0) | (node.darkenSU ? DARKEN_SU : 0) |
+	                (node.darkenND ? DARKEN_ND : 0) | (node.darkenWD ? DARKEN_WD : 0));
+	xstarts.push_back(node.xstart);
+	ystarts.push_back(node.ystart);
+	RelBlockIdx rbi = {(int16_t)(node.bi.x - origin.x), (int16_t)(node.bi.z - origin.z), (int16_t)(node.bi.y - origin.y)};
+	blocks.push_back(rbi);
+	pending.resize(pending.size() + 6, -1);
+	return n;
+}
+
+void SceneGraph::finishEdges()
+{
+	int n = infos.size();
+	firstedges.resize(n + 1);
+	edges.resize(pending.size());
+	int count = 0;
+	for (int i = 0; i < n; i++)
+	{
+		firstedges[i] = count;
+		for (int slot = 0; slot < 6; slot++)
+		{
+			edges[count] = pending[i * 6 + slot];
+			count += (edges[count] != -1);
+		}
+	}
+	firstedges[n] = count;
+	edges.resize(count);
+	pending.clear();
+}
 
+bool SceneGraph::occludes(int node1, int node2) const
+{
+	// (same as BlockIdx::occludes, which only looks at differences)
+	int dx = blocks[node2].x - blocks[node1].x, dz = blocks[node2].z - blocks[node1].z, dy = blocks[node2].y - blocks[node1].y;
+	// (no early return; this is called a lot, and the branches don't predict well)
+	return (dx >= 0) & (dz <= 0) & (dy <= 0) & (dx*2 + dz*2 <= 2) & (-dx + dz - dy*2 <= 2);
+}
 
 // travel down two neighboring pseudocolumns, setting occlusion edges between their nodes
 // ...the first pcol must be N, E, or SE of the second one, and the "which" parameter tells
@@ -148,15 +307,15 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 	{
 		// if node1 occludes node2, then scan down pcol1 and see if there are any lower
 		//  nodes that also occlude it; use the lowest one, then set node1 to the one after it
-		if (sg.nodes[node1].bi.occludes(sg.nodes[node2].bi))
+		if (sg.occludes(node1, node2))
 		{
-			int next1 = sg.nodes[node1].children[0];
-			while (next1 != -1 && sg.nodes[next1].bi.occludes(sg.nodes[node2].bi))
+			int next1 = sg.getBelow(node1);
+			while (next1 != -1 && sg.occludes(next1, node2))
 			{
 				node1 = next1;
-				next1 = sg.nodes[node1].children[0];
+				next1 = sg.getBelow(node1);
 			}
-			sg.nodes[node1].children[which] = node2;
+			sg.addEdge(node1, which, node2);
 			node1 = next1;
 		}
 
@@ -164,15 +323,15 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 			return;
 
 		// ...same thing for the other direction
-		if (sg.nodes[node2].bi.occludes(sg.nodes[node1].bi))
+		if (sg.occludes(node2, node1))
 		{
-			int next2 = sg.nodes[node2].children[0];
-			while (next2 != -1 && sg.nodes[next2].bi.occludes(sg.nodes[node1].bi))
+			int next2 = sg.getBelow(node2);
+			while (next2 != -1 && sg.occludes(next2, node1))
 			{
 				node2 = next2;
-				next2 = sg.nodes[node2].children[0];
+				next2 = sg.getBelow(node2);
 			}
-			sg.nodes[node2].children[which - 3] = node1;
+			sg.addEdge(node2, which - 3, node1);
 			node2 = next2;
 		}
 
@@ -186,23 +345,24 @@ struct Block
 	uint16_t id;
 	uint8_t data;
 	
-	inline Block(uint16_t id_, uint8_t data_): id(id_), data(data_) {}
+	// (from ID << 4 | data, as returned by ChunkData::block)
+	inline Block(uint16_t block): id(block >> 4), data(block & 0xf) {}
 };
 
 inline Block getNeighbor(ChunkData *chunkdata, RenderJob& rj, const PosChunkIdx& ci, const BlockIdx& bin)
 {
 	PosChunkIdx cin = bin.getChunkIdx();
 	if (cin != ci)
-		chunkdata = rj.chunkcache->getData(cin);
+		chunkdata = rj.chunkreader->getData(cin);
 
-	return Block(chunkdata->id(bin), chunkdata->data(bin));
+	return Block(chunkdata->block(bin));
 }
 
 inline Block getNeighborUD(ChunkData* chunkdata, const BlockIdx& bin)
 {
 	if (bin.y >= 0 && bin.y <= 255)
-		return Block(chunkdata->id(bin), chunkdata->data(bin));
-	return Block(0, 0);
+		return Block(chunkdata->block(bin));
+	return Block(0);
 }
 
 inline bool connectFence(RenderJob& rj, const Block& block)
@@ -534,45 +694,87 @@ void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	}
 }
 
-void drawNode(SceneGraphNode& node, RGBAImage& img, const BlockImages& blockimages)
+void drawNode(SceneGraph& sg, int node, RGBAImage& img, const BlockImages& blockimages)
 {
-	alphablit(blockimages.img, blockimages.getRect(node.bimgoffset), img, node.xstart, node.ystart);
-	if (node.darkenEU)
-		darkenEUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
-	if (node.darkenSU)
-		darkenSUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
-	if (node.darkenND)
-		darkenNDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
-	if (node.darkenWD)
-		darkenWDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
-	node.drawn = true;
+	uint32_t info = sg.infos[node];
+	int32_t xstart = sg.xstarts[node], ystart = sg.ystarts[node];
+	alphablit(blockimages.img, blockimages.getRect(info & SceneGraph::OFFSET_MASK), img, xstart, ystart);
+	if (info & SceneGraph::DARKEN_EU)
+		darkenEUEdge(img, xstart, ystart, blockimages.rectsize / 4);
+	if (info & SceneGraph::DARKEN_SU)
+		darkenSUEdge(img, xstart, ystart, blockimages.rectsize / 4);
+	if (info & SceneGraph::DARKEN_ND)
+		darkenNDEdge(img, xstart, ystart, blockimages.rectsize / 4);
+	if (info & SceneGraph::DARKEN_WD)
+		darkenWDEdge(img, xstart, ystart, blockimages.rectsize / 4);
+	sg.infos[node] = info | SceneGraph::DRAWN;
 }
 
-void drawSubgraph(SceneGraph& sg, int rootnode, RGBAImage& img, const BlockImages& blockimages)
+// find the first child of a node that hasn't been drawn yet, or -1
+inline int firstUndrawnChild(const SceneGraph& sg, int node)
 {
-	if (sg.nodes[rootnode].drawn)
+	int below = sg.getBelow(node);
+	if (below != -1 && !sg.isDrawn(below))
+		return below;
+	for (int e = sg.firstedges[node]; e < sg.firstedges[node + 1]; e++)
+		if (!sg.isDrawn(sg.edges[e]))
+			return sg.edges[e];
+	return -1;
+}
+
+// visit every node reachable from rootnode that isn't drawn yet, children first; the visitor is called as
+//  visit(sg, node) and must mark the node drawn
+template <class Visitor> void visitSubgraph(SceneGraph& sg, int rootnode, Visitor& visit)
+{
+	if (sg.isDrawn(rootnode))
 		return;
 	vector<int>& stack = sg.nodestack;
 	stack.clear();
 	stack.push_back(rootnode);
 	while (!stack.empty())
 	{
-		SceneGraphNode& node = sg.nodes[stack.back()];
-		bool pushed = false;
-		for (int i = 0; i < 7; i++)
-			if (node.children[i] != -1 && !sg.nodes[node.children[i]].drawn)
-			{
-				stack.push_back(node.children[i]);
-				pushed = true;
-				break;
-			}
-		if (pushed)
+		int child = firstUndrawnChild(sg, stack.back());
+		if (child != -1)
+		{
+			stack.push_back(child);
 			continue;
-		drawNode(node, img, blockimages);
+		}
+		visit(sg, stack.back());
 		stack.pop_back();
 	}
 }
 
+struct nodeDrawer
+{
+	RGBAImage& img;
+	const BlockImages& blockimages;
+	nodeDrawer(RGBAImage& i, const BlockImages& bi) : img(i), blockimages(bi) {}
+	void operator()(SceneGraph& sg, int node) {drawNode(sg, node, img, blockimages);}
+};
+
+void drawSubgraph(SceneGraph& sg, int rootnode, RGBAImage& img, const BlockImages& blockimages)
+{
+	nodeDrawer drawer(img, blockimages);
+	visitSubgraph(sg, rootnode, drawer);
+}
+
+// records how long a base tile took, once it goes out of scope
+struct tileCostRecorder
+{
+	RenderJob& rj;
+	TileIdx ti;
+	int64_t start;
+	tileCostRecorder(RenderJob& r, const TileIdx& t) : rj(r), ti(t), start(getMicroseconds()) {}
+	~tileCostRecorder()
+	{
+		TileCostTable::Entry e;
+		e.x = ti.x;
+		e.y = ti.y;
+		e.cost = min(getMicroseconds() - start, (int64_t)0xffffffff);
+		rj.tilecosts.push_back(e);
+	}
+};
+
 //!!!!!!!!!!!!! many opportunities for optimization in here
 bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 {
@@ -587,19 +789,19 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 		cerr << "tile [" << ti.x << "," << ti.y << "] exceeds the possible map size!  skipping..." << endl;
 		return false;
 	}
-	// if we've somehow already drawn this tile (which should not be possible!), skip it
-	if (rj.tiletable->isDrawn(ti))
+	// mark this tile drawn; if we've somehow already drawn it (which should not be possible!), skip it
+	if (rj.tiletable->setDrawn(ti))
 	{
 		cerr << "attempted to draw tile [" << ti.x << "," << ti.y << "] more than once!" << endl;
 		return false;
 	}
-	
-	// mark this tile drawn
-	rj.tiletable->setDrawn(ti);
+	if (rj.prefetch != NULL)
+		rj.prefetch->tileStarted();
 
 	// if we're in test mode, don't actually draw anything
 	if (rj.testmode)
 		return true;
+	tileCostRecorder tcr(rj, ti);
 
 	SceneGraph& sg = *rj.scenegraph;
 	sg.clear();
@@ -630,18 +832,27 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 			// look up chunk data (we might have it already)
 			PosChunkIdx ci = pcit.current.getChunkIdx();
 			if (ci != lastci)
-				chunkdata = rj.chunkcache->getData(ci);
+				chunkdata = rj.chunkreader->getData(ci);
+
+			// if we're above the terrain here (or in an empty section), skip over the air, as far as the edge of
+			//  the chunk (the last step is taken by the loop)
+			int airsteps = chunkdata->airSteps(pcit.current);
+			if (airsteps > 0)
+			{
+				pcit.advance(airsteps - 1);
+				continue;
+			}
 
-			// get block type
-			uint16_t blockID = chunkdata->id(pcit.current);
+			// get block type and data
+			uint16_t block = chunkdata->block(pcit.current);
+			uint16_t blockID = block >> 4;
 
 			// if this is air, move on (we *always* consider air to be transparent; it has no block image)
 			if (blockID == 0)
 				continue;
 				
-			// get the block data
-			uint8_t blockData = chunkdata->data(pcit.current);
-			int initialoffset = blockimages.getOffset(blockID, blockData);  // we might use a different one after checkSpecial
+			uint8_t blockData = block & 0xf;
+			int initialoffset = blockimages.getOffset(block);  // we might use a different one after checkSpecial
 
 			// create a node for this block
 			SceneGraphNode node(tbit.current.x + xoff, tbit.current.y + yoff, pcit.current, initialoffset);
@@ -655,12 +866,11 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 				continue;
 
 			// commit the node
-			int thisnode = sg.nodes.size();
-			sg.nodes.push_back(node);
+			int thisnode = sg.addNode(node);
 
 			// link our parent (the node above us in our own pseudocolumn) to us
 			if (prevnode != -1)
-				sg.nodes[prevnode].children[0] = thisnode;
+				sg.setBelow(prevnode);
 			// ...if we have no parent, then we're the top of this pcol
 			else
 				sg.pcols.back() = thisnode;
@@ -682,16 +892,16 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 	
 	// if we didn't find anything to draw--i.e. our final image will be fully transparent--then there's
 	//  no sense saving it to disk
-	if (sg.nodes.empty())
+	if (sg.empty())
 		return false;
 
 	// step 2: traverse the graph and draw the image
-	for (int i = 0; i < (int)sg.nodes.size(); i++)
+	sg.finishEdges();
+	for (int i = 0; i < sg.size(); i++)
 		drawSubgraph(sg, i, tile, blockimages);
 
 	// save the image to disk
-	if (!tile.writeImage(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	writeTile(rj, tile, tilefile);
 	return true;
 }
 
@@ -715,92 +925,44 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile)
 	zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2]);
 	zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3]);
 
-	// if none of the subtiles are used, we have nothing to do
-	int usedcount = 0;
-	for (int i = 0; i < 4; i++)
-		if (zlevel.used[i])
-			usedcount++;
-	if (usedcount == 0)
-		return false;
-
-	// if we're in test mode, pretend we've successfully drawn
-	if (rj.testmode)
-		return true;
-
-	// if some of the subtiles are unused and this is an incremental update, we need to
-	//  load the existing version of this tile (if there is one) to get the unchanged portions
-	string tilefile = rj.outputpath + "/" + zti.toFilePath();
-	if (usedcount < 4 && !rj.fullrender)
-	{
-		// if it doesn't read, no big deal (it may not exist anyway)
-		if (!tile.readPNG(tilefile + ".png") || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
-			tile.create(rj.mp.tileSize(), rj.mp.tileSize());
-	}
-	else
-		tile.create(rj.mp.tileSize(), rj.mp.tileSize());
-
-	// combine the four subtile images into this tile's image
-	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), zlevel.tiles[0]);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), zlevel.tiles[1]);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), zlevel.tiles[2]);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), zlevel.tiles[3]);
-
-	// save to disk
-	if (!tile.writeImage(tilefile))
-		cerr << "failed to write " << tilefile << endl;
-	return true;
+	const RGBAImage *subtiles[4] = {&zlevel.tiles[0], &zlevel.tiles[1], &zlevel.tiles[2], &zlevel.tiles[3]};
+	return combineZoomTile(zti, rj, tile, zlevel.used, subtiles);
 }
 
 
 
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache)
+bool combineZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& below)
 {
-	// if this is at or below the ThreadOutputCache level, abort
-	if (zti.zoom >= tocache.zoom)
-		return false;
-
-	// get the four subtiles: if we're one level above the ThreadOutputCache level, they're in the
-	//  cache; otherwise, we recurse
-	// ...we use the ZoomLevel::used bits either way
-	TileCache::ZoomLevel& zlevel = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
+	// get the four subtiles from the level below
+	// (any that were spilled to disk get read back into temporary buffers)
 	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
-	const RGBAImage *tile0, *tile1, *tile2, *tile3;
-	if (zti.zoom == tocache.zoom - 1)
-	{
-		int idx = tocache.getIndex(topleft);
-		zlevel.used[0] = tocache.used[idx];
-		tile0 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(0,1));
-		zlevel.used[1] = tocache.used[idx];
-		tile1 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,0));
-		zlevel.used[2] = tocache.used[idx];
-		tile2 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,1));
-		zlevel.used[3] = tocache.used[idx];
-		tile3 = &tocache.images[idx];
-	}
-	else
+	bool used[4];
+	const RGBAImage *subtiles[4];
+	RGBAImage bufs[4];
+	ZoomTileIdx sub[4] = {topleft, topleft.add(0,1), topleft.add(1,0), topleft.add(1,1)};
+	for (int i = 0; i < 4; i++)
 	{
-		zlevel.used[0] = renderZoomTile(topleft, rj, zlevel.tiles[0], tocache);
-		tile0 = &zlevel.tiles[0];
-		zlevel.used[1] = renderZoomTile(topleft.add(0,1), rj, zlevel.tiles[1], tocache);
-		tile1 = &zlevel.tiles[1];
-		zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2], tocache);
-		tile2 = &zlevel.tiles[2];
-		zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3], tocache);
-		tile3 = &zlevel.tiles[3];
+		int idx = below.getIndex(sub[i]);
+		used[i] = below.used[idx];
+		subtiles[i] = below.getImage(idx, bufs[i]);
+		if (subtiles[i] == NULL)
+		{
+			cerr << "failed to read tile " << sub[i].toFilePath() << " back from spill file!" << endl;
+			used[i] = false;
+			subtiles[i] = &bufs[i];
+		}
 	}
+	return combineZoomTile(zti, rj, tile, used, subtiles);
+}
+
 
+
+bool combineZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const bool used[4], const RGBAImage * const subtiles[4])
+{
 	// if none of the subtiles are used, we have nothing to do
 	int usedcount = 0;
 	for (int i = 0; i < 4; i++)
-		if (zlevel.used[i])
+		if (used[i])
 			usedcount++;
 	if (usedcount == 0)
 		return false;
@@ -823,18 +985,17 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, cons
 
 	// combine the four subtile images into this tile's image
 	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), *tile0);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), *tile1);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), *tile2);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), *tile3);
+	if (used[0])
+		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), *subtiles[0]);
+	if (used[1])
+		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), *subtiles[1]);
+	if (used[2])
+		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), *subtiles[2]);
+	if (used[3])
+		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), *subtiles[3]);
 
 	// save to disk
-	if (!tile.writeImage(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	writeTile(rj, tile, tilefile);
 	return true;
 }
 
@@ -954,3 +1115,205 @@ void testPColIterator()
 			}
 		}
 }
+
+
+
+// for benchSceneGraph: the scene graph as it used to be, an array of structs with all seven children
+//  in each node
+struct OldSceneGraphNode
+{
+	int32_t xstart, ystart;
+	int bimgoffset;
+	bool darkenEU, darkenSU, darkenND, darkenWD;
+	bool drawn;
+	BlockIdx bi;
+	int children[7];
+
+	OldSceneGraphNode(int32_t x, int32_t y, const BlockIdx& bidx, int offset)
+		: xstart(x), ystart(y), bimgoffset(offset), darkenEU(false), darkenSU(false), darkenND(false), darkenWD(false),
+		drawn(false), bi(bidx) {std::fill(children, children + 7, -1);}
+};
+
+struct OldSceneGraph
+{
+	vector<OldSceneGraphNode> nodes;
+	vector<int> pcols;
+	vector<int> nodestack;
+	void clear() {nodes.clear(); pcols.clear();}
+	OldSceneGraph() {nodes.reserve(2048);}
+};
+
+void oldBuildDependencies(OldSceneGraph& sg, int pcol1, int pcol2, int which)
+{
+	int node1 = sg.pcols[pcol1], node2 = sg.pcols[pcol2];
+	if (node1 == -1 || node2 == -1)
+		return;
+	while (true)
+	{
+		if (sg.nodes[node1].bi.occludes(sg.nodes[node2].bi))
+		{
+			int next1 = sg.nodes[node1].children[0];
+			while (next1 != -1 && sg.nodes[next1].bi.occludes(sg.nodes[node2].bi))
+			{
+				node1 = next1;
+				next1 = sg.nodes[node1].children[0];
+			}
+			sg.nodes[node1].children[which] = node2;
+			node1 = next1;
+		}
+		if (node1 == -1)
+			return;
+		if (sg.nodes[node2].bi.occludes(sg.nodes[node1].bi))
+		{
+			int next2 = sg.nodes[node2].children[0];
+			while (next2 != -1 && sg.nodes[next2].bi.occludes(sg.nodes[node1].bi))
+			{
+				node2 = next2;
+				next2 = sg.nodes[node2].children[0];
+			}
+			sg.nodes[node2].children[which - 3] = node1;
+			node2 = next2;
+		}
+		if (node2 == -1)
+			return;
+	}
+}
+
+// returns a checksum of the visiting order
+int64_t oldVisitAll(OldSceneGraph& sg)
+{
+	int64_t sum = 0, count = 0;
+	for (int i = 0; i < (int)sg.nodes.size(); i++)
+	{
+		if (sg.nodes[i].drawn)
+			continue;
+		vector<int>& stack = sg.nodestack;
+		stack.clear();
+		stack.push_back(i);
+		while (!stack.empty())
+		{
+			OldSceneGraphNode& node = sg.nodes[stack.back()];
+			bool pushed = false;
+			for (int c = 0; c < 7; c++)
+				if (node.children[c] != -1 && !sg.nodes[node.children[c]].drawn)
+				{
+					stack.push_back(node.children[c]);
+					pushed = true;
+					break;
+				}
+			if (pushed)
+				continue;
+			node.drawn = true;
+			sum += (int64_t)stack.back() * ++count + node.xstart + node.ystart + node.bimgoffset;
+			stack.pop_back();
+		}
+	}
+	return sum;
+}
+
+struct nodeSummer
+{
+	int64_t sum, count;
+	nodeSummer() : sum(0), count(0) {}
+	void operator()(SceneGraph& sg, int node)
+	{
+		sg.infos[node] |= SceneGraph::DRAWN;
+		sum += (int64_t)node * ++count + sg.xstarts[node] + sg.ystarts[node] + sg.getOffset(node);
+	}
+};
+
+// build and traverse the scene graph of a dense tile--every pseudocolumn DEPTH blocks deep, as with water or
+//  leaves--in both the old layout and the current one, without drawing anything (the checksums should match)
+// ...reports the best of several runs of each, since the differences are small next to timing noise
+void benchSceneGraph()
+{
+	const int DEPTH = 24;
+	const int reps = 50;
+	MapParams mp(6, 2, 0);
+	TileIdx ti(0, 0);
+	BBox tilebb = ti.getBBox(mp);
+	int64_t xoff = -tilebb.topLeft.x - 2*mp.B;
+	int64_t yoff = -tilebb.topLeft.y - 2*mp.B;
+
+	OldSceneGraph oldsg;
+	int64_t oldsum = 0, oldbuild = -1, oldvisit = -1;
+	for (int rep = 0; rep < reps; rep++)
+	{
+		int64_t start = getMicroseconds();
+		oldsg.clear();
+		for (TileBlockIterator tbit(ti, mp); !tbit.end; tbit.advance())
+		{
+			oldsg.pcols.push_back(-1);
+			int prevnode = -1, depth = 0;
+			for (PseudocolumnIterator pcit(tbit.current, mp); !pcit.end && depth < DEPTH; pcit.advance(), depth++)
+			{
+				int thisnode = oldsg.nodes.size();
+				oldsg.nodes.push_back(OldSceneGraphNode(tbit.current.x + xoff, tbit.current.y + yoff, pcit.current, (depth + rep) % 1000));
+				if (prevnode != -1)
+					oldsg.nodes[prevnode].children[0] = thisnode;
+				else
+					oldsg.pcols.back() = thisnode;
+				prevnode = thisnode;
+			}
+			if (tbit.nextN != -1)
+				oldBuildDependencies(oldsg, tbit.nextN, tbit.pos, 4);
+			if (tbit.nextE != -1)
+				oldBuildDependencies(oldsg, tbit.nextE, tbit.pos, 5);
+			if (tbit.nextSE != -1)
+				oldBuildDependencies(oldsg, tbit.nextSE, tbit.pos, 6);
+		}
+		int64_t built = getMicroseconds();
+		oldsum += oldVisitAll(oldsg);
+		int64_t visited = getMicroseconds();
+		if (oldbuild == -1 || built - start < oldbuild)
+			oldbuild = built - start;
+		if (oldvisit == -1 || visited - built < oldvisit)
+			oldvisit = visited - built;
+	}
+
+	SceneGraph sg;
+	int64_t newsum = 0, newbuild = -1, newvisit = -1;
+	for (int rep = 0; rep < reps; rep++)
+	{
+		int64_t start = getMicroseconds();
+		sg.clear();
+		for (TileBlockIterator tbit(ti, mp); !tbit.end; tbit.advance())
+		{
+			sg.pcols.push_back(-1);
+			int prevnode = -1, depth = 0;
+			for (PseudocolumnIterator pcit(tbit.current, mp); !pcit.end && depth < DEPTH; pcit.advance(), depth++)
+			{
+				int thisnode = sg.addNode(SceneGraphNode(tbit.current.x + xoff, tbit.current.y + yoff, pcit.current, (depth + rep) % 1000));
+				if (prevnode != -1)
+					sg.setBelow(prevnode);
+				else
+					sg.pcols.back() = thisnode;
+				prevnode = thisnode;
+			}
+			if (tbit.nextN != -1)
+				buildDependencies(sg, tbit.nextN, tbit.pos, 4);
+			if (tbit.nextE != -1)
+				buildDependencies(sg, tbit.nextE, tbit.pos, 5);
+			if (tbit.nextSE != -1)
+				buildDependencies(sg, tbit.nextSE, tbit.pos, 6);
+		}
+		sg.finishEdges();
+		int64_t built = getMicroseconds();
+		nodeSummer summer;
+		for (int i = 0; i < sg.size(); i++)
+			visitSubgraph(sg, i, summer);
+		newsum += summer.sum;
+		int64_t visited = getMicroseconds();
+		if (newbuild == -1 || built - start < newbuild)
+			newbuild = built - start;
+		if (newvisit == -1 || visited - built < newvisit)
+			newvisit = visited - built;
+	}
+
+	size_t oldbytes = oldsg.nodes.size() * sizeof(OldSceneGraphNode);
+	size_t newbytes = sg.size() * (sizeof(uint32_t) + 2 * sizeof(int16_t) + sizeof(SceneGraph::RelBlockIdx) + sizeof(int32_t)) +
+	                  sg.edges.size() * sizeof(int32_t);
+	cout << sg.size() << " nodes, " << sg.edges.size() << " edges" << endl;
+	cout << "old: build " << oldbuild << " us, traverse " << oldvisit << " us, " << oldbytes << " bytes   (checksum " << oldsum << ")" << endl;
+	cout << "new: build " << newbuild << " us, traverse " << newvisit << " us, " << newbytes << " bytes   (checksum " << newsum << ")" << endl;
+}
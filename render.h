@@ -19,13 +19,16 @@
 #define RENDER_H
 
 #include <string>
+#include <memory>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "map.h"
 #include "tables.h"
 #include "chunk.h"
 #include "blockimages.h"
 #include "rgba.h"
+#include "costs.h"
 
 
 
@@ -40,9 +43,26 @@ struct RenderStats
 };
 
 
+// settings that affect how the render is carried out (but not what it produces)
+namespace RenderSettings
+{
+	extern int prefetchThreads;  // threads reading chunks ahead of the render threads (0 for none)
+	extern int encoderThreads;  // threads encoding and writing tile images (0 to write them inline)
+	extern int decoderThreads;  // threads helping to decode each new region's chunks together (0 for none)
+	extern int64_t memoryBudget;  // bytes for the ThreadOutputCache images (0 to choose automatically)
+	extern int64_t chunkCacheBudget;  // bytes for the shared ChunkCache (0 for the default size)
+	extern int64_t regionCacheBudget;  // bytes of region files cached by each thread
+	extern bool pinThreads;  // pin each render thread to its own CPU
+	extern bool extraStats;  // print more detailed statistics
+}
+
+
 struct SceneGraph;
 struct TileCache;
 struct ThreadOutputCache;
+struct PrefetchCursor;
+struct TileWriter;
+struct ChunkDecoder;
 
 struct RenderJob : private nocopy
 {
@@ -51,18 +71,26 @@ struct RenderJob : private nocopy
 	MapParams mp;
 	std::string inputpath, outputpath;
 	BlockImages blockimages;
-	std::auto_ptr<ChunkTable> chunktable;
-	std::auto_ptr<ChunkCache> chunkcache;
-	std::auto_ptr<RegionTable> regiontable;
+	// the tables are shared by all the threads' jobs, so they're owned elsewhere
+	ChunkTable *chunktable;
+	RegionTable *regiontable;
+	TileTable *tiletable;
+	std::auto_ptr<ChunkCache> chunkcache;  // when multithreaded, the shared cache belongs to the main thread's job
 	std::auto_ptr<RegionCache> regioncache;
-	std::auto_ptr<TileTable> tiletable;
+	std::auto_ptr<ChunkCacheReader> chunkreader;  // this thread's access to the ChunkCache
 	std::auto_ptr<TileCache> tilecache;
 	std::auto_ptr<SceneGraph> scenegraph;  // reuse this for each tile to avoid reallocation
+	PrefetchCursor *prefetch;  // tells the prefetch threads where this thread is (NULL if not prefetching)
+	TileWriter *writer;  // shared queue of tiles to be written to disk (NULL to write them ourselves)
+	ChunkDecoder *decoder;  // shared pool for decoding whole regions' chunks at once (NULL to read them one by one)
+	std::vector<TileCostTable::Entry> tilecosts;  // how long each base tile we've drawn took
 	RenderStats stats;
 
 	// don't actually draw anything or read chunks; just iterate through the data structures
-	// ...scenegraph, chunkcache, and regioncache are not required if in test mode
+	// ...scenegraph, chunkcache, chunkreader, and regioncache are not required if in test mode
 	bool testmode;
+
+	RenderJob() : chunktable(NULL), regiontable(NULL), tiletable(NULL), prefetch(NULL), writer(NULL), decoder(NULL) {}
 };
 
 // render a base tile into an RGBAImage, and also write it to disk
@@ -74,9 +102,14 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile);
 // do nothing and return false if the tile is not required
 bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile);
 
-// for second phase of multithreaded operation: recursively render all the required tiles that a zoom tile
-//  depends on, but stop recursing at the ThreadOutputCache level rather than the base tile level
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache);
+
+// build a zoom tile from its four already-rendered subtiles (in the order [0,0], [0,1], [1,0], [1,1]), and
+//  write it to disk; return false if none of the subtiles are used
+bool combineZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const bool used[4], const RGBAImage * const subtiles[4]);
+
+// for second phase of multithreaded operation: build a zoom tile from its four subtiles, which have already
+//  been rendered into a ThreadOutputCache for the level below
+bool combineZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& below);
 
 
 
@@ -103,17 +136,39 @@ struct TileCache
 
 
 // when rendering with multiple threads, the individual threads only go up to a certain zoom level, then
-//  the main thread does the last few levels on its own; the worker threads store their results in this
-struct ThreadOutputCache
+//  the last few levels are built from their results (see runMultithreaded); the results are stored in this
+// ...if the images don't all fit in the memory budget, the ones that don't fit are written raw to a
+//  spill file and read back when they're needed
+struct ThreadOutputCache : private nocopy
 {
     int zoom;  // which zoom level the threads are working at
 
 	std::vector<RGBAImage> images;  // use getIndex() to get index into this from zoom tile
-	std::vector<bool> used;  // which images actually have data
+	// which images actually have data (not vector<bool>, since different threads set neighboring
+	//  entries at the same time)
+	std::vector<uint8_t> used;
+
+	int64_t budget;  // bytes of image data to keep in memory (0 for no limit)
+	int64_t inmemory;  // bytes of image data currently in memory (atomic)
+	std::vector<int64_t> spilled;  // offset of each image in the spill file, or -1 if not spilled
+	int spillfd;  // -1 if there's no spill file (yet)
+	int64_t spillend;  // end of the data in the spill file (atomic)
+	std::string spillpath;  // mkstemp template for the spill file (empty if there's no spill directory)
+	int spillfailed;  // set (atomic) if the spill file couldn't be created, so we've stopped spilling
+	pthread_mutex_t spillmutex;  // protects the creation of the spill file
 
 	int getIndex(const ZoomTileIdx& zti) const;  // get index into images, or -1 if zoom is wrong
 
-	ThreadOutputCache(int z) : zoom(z), images((1 << zoom) * (1 << zoom)), used((1 << zoom) * (1 << zoom), false) {}
+	// record whether a rendered image has data; if keeping it would take us over budget, spill it
+	void store(int idx, bool u);
+
+	// get an image: either the one in memory, or the one from the spill file, read into buf
+	// ...returns NULL if the image was spilled but can't be read back
+	const RGBAImage* getImage(int idx, RGBAImage& buf) const;
+
+	// the spill file, if needed, is created in spilldir (and deleted when we're done with it)
+	ThreadOutputCache(int z, int64_t budg = 0, const std::string& spilldir = "");
+	~ThreadOutputCache();
 };
 
 
@@ -127,44 +182,84 @@ struct ThreadOutputCache
 //  the topmost occluded block in a pseudocolumn
 // a block can be drawn when all its descendents have been drawn
 
+// a block that's about to go into the SceneGraph (checkSpecial may change its offset and flags first)
 struct SceneGraphNode
 {
 	int32_t xstart, ystart;  // top-left corner of block bounding box in tile image coords
 	int bimgoffset;  // offset into blockimages
 	// whether to darken various edges to indicate drop-off
 	bool darkenEU, darkenSU, darkenND, darkenWD;
-	bool drawn;
 	BlockIdx bi;
-	// first child is same pseudocolumn, then N, E, SE, S, W, NW; values are indices into
-	//  the SceneGraph's nodes vector, or -1 for "null"
-	int children[7];
 
 	SceneGraphNode(int32_t x, int32_t y, const BlockIdx& bidx, int offset)
 		: xstart(x), ystart(y), bimgoffset(offset), darkenEU(false), darkenSU(false), darkenND(false), darkenWD(false),
-		drawn(false), bi(bidx) {std::fill(children, children + 7, -1);}
+		bi(bidx) {}
 };
 
+// the nodes are kept as parallel arrays, packed down so that a dense tile's graph stays in cache while it's
+//  built and drawn:
+//  -each node's offset and flags share one 32-bit value
+//  -image coords are 16 bits (tiles are at most 16384 pixels across)
+//  -block coords are 16 bits, relative to the first block added (a tile spans far fewer blocks than that)
+//  -the first child (the next block down the same pseudocolumn) is always the next node, so it's just a
+//    flag; the other children go in a single edge list once the graph is built, with each node's children
+//    together, and nodes without any taking no space
 struct SceneGraph
 {
+	// flags in the high bits of infos (the block image offset is in the rest)
+	static const uint32_t DARKEN_EU = 1u << 31, DARKEN_SU = 1u << 30, DARKEN_ND = 1u << 29, DARKEN_WD = 1u << 28;
+	static const uint32_t HAS_BELOW = 1u << 27;  // next node is in the same pseudocolumn, below this one
+	static const uint32_t DRAWN = 1u << 26;
+	static const uint32_t OFFSET_MASK = DRAWN - 1;
+
+	struct RelBlockIdx
+	{
+		int16_t x, z, y;
+	};
+
 	// all nodes from all pseudocolumns go in here, in sequence (ordered by pseudocolumn, and within
 	//  pseudocolumns by height)
-	std::vector<SceneGraphNode> nodes;
-	// offset into nodes vector of each pseudocolumn (-1 for pseudocolumns with no nodes)
+	std::vector<uint32_t> infos;
+	std::vector<int16_t> xstarts, ystarts;  // top-left corner of block bounding box in tile image coords
+	std::vector<RelBlockIdx> blocks;  // relative to origin
+	// while building, the other children of node N go in pending[N * 6 + slot - 1] (-1 for none), where slot
+	//  is which neighboring pseudocolumn they're in (1-6: N, E, SE, S, W, NW)
+	std::vector<int32_t> pending;
+	// finishEdges then packs them into the edge list: the children of node N are edges[firstedges[N]] up to
+	//  edges[firstedges[N + 1]], in slot order
+	std::vector<int32_t> firstedges;
+	std::vector<int32_t> edges;
+	BlockIdx origin;
+	// offset into nodes of each pseudocolumn (-1 for pseudocolumns with no nodes)
 	std::vector<int> pcols;
 
-	void clear() {nodes.clear(); pcols.clear();}
+	void clear() {infos.clear(); xstarts.clear(); ystarts.clear(); blocks.clear(); pending.clear(); firstedges.clear(); edges.clear(); pcols.clear();}
+	int size() const {return infos.size();}
+	bool empty() const {return infos.empty();}
 
 	int getTopNode(int pcol) {return pcols[pcol];}
 
+	// append a node, and return its index
+	int addNode(const SceneGraphNode& node);
+	// the node's child in its own pseudocolumn, or -1
+	int getBelow(int node) const {return (infos[node] & HAS_BELOW) ? node + 1 : -1;}
+	void setBelow(int node) {infos[node] |= HAS_BELOW;}
+	// add an edge from one node to the topmost block it occludes in a neighboring pseudocolumn
+	void addEdge(int node, int slot, int target) {pending[node * 6 + slot - 1] = target;}
+	// pack the added edges into edges/firstedges; must be called after the last addEdge, before traversing
+	void finishEdges();
+
+	int getOffset(int node) const {return infos[node] & OFFSET_MASK;}
+	bool isDrawn(int node) const {return infos[node] & DRAWN;}
+	bool occludes(int node1, int node2) const;
+
 	// scratch space for use while traversing the DAG
 	std::vector<int> nodestack;
 
-	SceneGraph() {nodes.reserve(2048);}
+	SceneGraph() : origin(0,0,0) {infos.reserve(2048); xstarts.reserve(2048); ystarts.reserve(2048); blocks.reserve(2048); pending.reserve(2048 * 6); firstedges.reserve(2049); edges.reserve(8192);}
 };
 
 
-
-
 // iterate over the hexagonal block-center grid pixels whose blocks touch a tile
 struct TileBlockIterator
 {
@@ -202,6 +297,8 @@ struct PseudocolumnIterator
 
 	// move to the next block (which is one step SED), or the end
 	void advance();
+	// move several steps at once
+	void advance(int64_t steps);
 };
 
 
@@ -209,6 +306,7 @@ struct PseudocolumnIterator
 
 void testTileIterator();
 void testPColIterator();
+void benchSceneGraph();
 
 
 #endif // RENDER_H
\ No newline at end of file
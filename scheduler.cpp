@@ -0,0 +1,218 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <iostream>
+
+#include "scheduler.h"
+
+using namespace std;
+
+
+TileScheduler::TileScheduler(int threads, const TileTable& ttable, const MapParams& mparams, ThreadOutputCache& toc)
+	: deques(threads), tiletable(ttable), mp(mparams), tocache(toc), idlecount(0), generation(0), outstanding(0), queued(0)
+{
+	for (int i = 0; i < threads; i++)
+		deques[i] = new WorkerDeque;
+	pthread_mutex_init(&idlemutex, NULL);
+	pthread_cond_init(&idlecond, NULL);
+}
+
+TileScheduler::~TileScheduler()
+{
+	for (vector<WorkerDeque*>::iterator it = deques.begin(); it != deques.end(); it++)
+		delete *it;
+	pthread_mutex_destroy(&idlemutex);
+	pthread_cond_destroy(&idlecond);
+}
+
+void TileScheduler::addTask(int thread, const TileTask& task)
+{
+	mutexLocker ml(deques[thread]->mutex);
+	deques[thread]->tasks.push_back(task);
+	__sync_add_and_fetch(&outstanding, 1);
+	__sync_add_and_fetch(&queued, 1);
+}
+
+bool TileScheduler::getTask(int thread, TileTask& task)
+{
+	WorkerDeque& wd = *deques[thread];
+	for (;;)
+	{
+		// take from the front of our own deque, if there's anything there
+		{
+			mutexLocker ml(wd.mutex);
+			if (!wd.tasks.empty())
+			{
+				task = wd.tasks.front();
+				wd.tasks.pop_front();
+				__sync_sub_and_fetch(&queued, 1);
+				wd.executed++;
+				return true;
+			}
+		}
+
+		// otherwise, try to take some tasks from someone else
+		if (stealTasks(thread))
+			continue;
+
+		// nothing to steal; if everything is done, we're finished, but if other threads are still
+		//  working, they may yet split their tasks, so wait for that
+		mutexLocker ml(idlemutex);
+		if (__sync_add_and_fetch(&outstanding, 0) == 0)
+			return false;
+		if (__sync_add_and_fetch(&queued, 0) > 0)
+			continue;
+		int64_t gen = generation;
+		idlecount++;
+		while (gen == generation && __sync_add_and_fetch(&outstanding, 0) > 0)
+			pthread_cond_wait(&idlecond, &idlemutex);
+		idlecount--;
+	}
+}
+
+bool TileScheduler::stealTasks(int thread)
+{
+	// find the thread with the most tasks waiting (the sizes may be out of date by the time we
+	//  get the lock, but that just means we might not pick the best victim)
+	int victim = -1;
+	size_t best = 0;
+	for (int i = 0; i < (int)deques.size(); i++)
+	{
+		if (i == thread)
+			continue;
+		mutexLocker ml(deques[i]->mutex);
+		if (deques[i]->tasks.size() > best)
+		{
+			best = deques[i]->tasks.size();
+			victim = i;
+		}
+	}
+	if (victim == -1)
+		return false;
+
+	// take half its tasks (rounded up) from the back--those are the ones it would have gotten to
+	//  last, so they're the least likely to share chunks with what it's working on now
+	vector<TileTask> loot;
+	{
+		mutexLocker ml(deques[victim]->mutex);
+		size_t count = (deques[victim]->tasks.size() + 1) / 2;
+		for (size_t i = 0; i < count; i++)
+		{
+			loot.push_back(deques[victim]->tasks.back());
+			deques[victim]->tasks.pop_back();
+		}
+	}
+	if (loot.empty())
+		return false;
+	mutexLocker ml(deques[thread]->mutex);
+	// keep the stolen tasks in their original order
+	deques[thread]->tasks.insert(deques[thread]->tasks.end(), loot.rbegin(), loot.rend());
+	deques[thread]->stolen += loot.size();
+	return true;
+}
+
+void TileScheduler::wakeIdle()
+{
+	mutexLocker ml(idlemutex);
+	generation++;
+	pthread_cond_broadcast(&idlecond);
+}
+
+bool TileScheduler::splitTask(int thread, const TileTask& task)
+{
+	// base tiles can't be split
+	if (task.zti.zoom >= mp.baseZoom)
+		return false;
+	// only split when the work is running out: either someone is already waiting, or there are
+	//  fewer tasks left in the deques than there are threads; before that, stealing whole tasks
+	//  is enough to keep everyone busy
+	if (__sync_add_and_fetch(&idlecount, 0) == 0 && __sync_add_and_fetch(&queued, 0) >= (int64_t)deques.size())
+		return false;
+	// no point splitting a tile that only has one base tile under it
+	if (tiletable.getNumRequired(task.zti, mp) <= 1)
+		return false;
+
+	SplitTile *st = new SplitTile(task.zti, task.parent, task.slot);
+	vector<TileTask> subtasks;
+	ZoomTileIdx topleft = task.zti.toZoom(task.zti.zoom + 1);
+	ZoomTileIdx subtiles[4] = {topleft, topleft.add(0,1), topleft.add(1,0), topleft.add(1,1)};
+	for (int i = 0; i < 4; i++)
+		if (tiletable.getNumRequired(subtiles[i], mp) > 0)
+			subtasks.push_back(TileTask(subtiles[i], st, i));
+	st->pending = subtasks.size();
+
+	// the subtiles go on the front of our own deque, so we'll work on them next, and anyone
+	//  stealing from us will take our older (bigger) tasks first
+	// ...the split task itself stays outstanding until its last subtile is done
+	{
+		WorkerDeque& wd = *deques[thread];
+		mutexLocker ml(wd.mutex);
+		wd.tasks.insert(wd.tasks.begin(), subtasks.begin(), subtasks.end());
+		wd.splits++;
+		wd.executed--;
+	}
+	__sync_add_and_fetch(&outstanding, subtasks.size());
+	__sync_add_and_fetch(&queued, subtasks.size());
+	wakeIdle();
+	return true;
+}
+
+RGBAImage& TileScheduler::getOutput(const TileTask& task)
+{
+	if (task.parent == NULL)
+		return tocache.images[tocache.getIndex(task.zti)];
+	return task.parent->tiles[task.slot];
+}
+
+void TileScheduler::finishTask(const TileTask& task, bool used, RenderJob& rj)
+{
+	TileTask current = task;
+	bool currentused = used;
+	for (;;)
+	{
+		// record the result where it belongs; if this was a subtile of a split tile, and it was
+		//  the last one, build the split tile and then pass that result up in turn
+		SplitTile *st = current.parent;
+		bool done = false;
+		if (st == NULL)
+		{
+			tocache.store(tocache.getIndex(current.zti), currentused);
+			done = true;
+		}
+		else
+		{
+			st->used[current.slot] = currentused;
+			// (the atomic decrement also makes the other threads' subtile images visible to us)
+			if (__sync_sub_and_fetch(&st->pending, 1) > 0)
+				done = true;
+		}
+		if (0 == __sync_sub_and_fetch(&outstanding, 1))
+			wakeIdle();
+		if (done)
+			return;
+
+		current = TileTask(st->zti, st->parent, st->slot);
+		const RGBAImage *subtiles[4] = {&st->tiles[0], &st->tiles[1], &st->tiles[2], &st->tiles[3]};
+		currentused = combineZoomTile(st->zti, rj, getOutput(current), st->used, subtiles);
+		delete st;
+	}
+}
+
+void TileScheduler::printStats() const
+{
+	for (int i = 0; i < (int)deques.size(); i++)
+		cout << "thread " << i << ": " << deques[i]->executed << " tasks   " << deques[i]->stolen << " stolen   "
+		     << deques[i]->splits << " split" << endl;
+}
@@ -0,0 +1,120 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "map.h"
+#include "tables.h"
+#include "rgba.h"
+#include "render.h"
+#include "utils.h"
+
+
+// when a zoom tile is split into its four subtiles (so that idle threads can take some of them), the subtile
+//  images are collected here; whichever thread finishes the last subtile builds the zoom tile itself
+struct SplitTile
+{
+	ZoomTileIdx zti;
+	// where the finished zoom tile goes: a subtile slot in another SplitTile, or the ThreadOutputCache
+	//  if parent is NULL
+	SplitTile *parent;
+	int slot;
+	int pending;  // number of subtiles still being rendered (decremented atomically)
+	bool used[4];
+	RGBAImage tiles[4];
+
+	SplitTile(const ZoomTileIdx& z, SplitTile *p, int s) : zti(z), parent(p), slot(s), pending(0) {std::fill(used, used + 4, false);}
+};
+
+// a unit of work: render a zoom tile (at the ThreadOutputCache level or below) and everything under it
+struct TileTask
+{
+	ZoomTileIdx zti;
+	SplitTile *parent;  // as in SplitTile: NULL means the result goes to the ThreadOutputCache
+	int slot;
+
+	TileTask() : zti(-1,-1,-1), parent(NULL), slot(-1) {}
+	TileTask(const ZoomTileIdx& z, SplitTile *p, int s) : zti(z), parent(p), slot(s) {}
+};
+
+// work-stealing scheduler for the render threads: each thread has its own deque of tasks, which it works
+//  through from the front; a thread that runs out steals half of the tasks from the back of the fullest
+//  deque, and when there's nothing left to steal, the remaining tasks get split into their subtiles as
+//  they're started, so that the idle threads have something to take
+// ...the deques are seeded by assignThreadTasks, so stealing only has to fix up whatever the static
+//  schedule got wrong
+struct TileScheduler : private nocopy
+{
+	struct WorkerDeque
+	{
+		pthread_mutex_t mutex;
+		std::deque<TileTask> tasks;
+		int64_t executed, stolen, splits;  // stats: tasks run, tasks taken from other threads, tasks split
+
+		WorkerDeque() : executed(0), stolen(0), splits(0) {pthread_mutex_init(&mutex, NULL);}
+		~WorkerDeque() {pthread_mutex_destroy(&mutex);}
+	};
+
+	std::vector<WorkerDeque*> deques;
+	const TileTable& tiletable;
+	const MapParams& mp;
+	ThreadOutputCache& tocache;
+
+	// idle threads wait here for new tasks (from splits) or for the end of the render
+	pthread_mutex_t idlemutex;
+	pthread_cond_t idlecond;
+	int idlecount;  // threads currently waiting for work
+	int64_t generation;  // bumped whenever tasks are added, so waiters don't miss a wakeup
+	int64_t outstanding;  // tasks that have been queued but not yet finished (atomic)
+	int64_t queued;  // tasks sitting in deques (atomic)
+
+	TileScheduler(int threads, const TileTable& ttable, const MapParams& mparams, ThreadOutputCache& toc);
+	~TileScheduler();
+
+	// add a task to a thread's deque (only used for the initial assignment)
+	void addTask(int thread, const TileTask& task);
+
+	// get the next task for a thread, stealing from the others if necessary; blocks while other threads
+	//  are still working on something that might be split; returns false once everything is finished
+	bool getTask(int thread, TileTask& task);
+
+	// see whether a task should be broken up instead of being rendered whole, and if so, replace it with
+	//  its required subtiles; returns true if the task was split (in which case it is not "finished")
+	bool splitTask(int thread, const TileTask& task);
+
+	// report that a task has been rendered (into the image returned by getOutput); if it was the last
+	//  subtile of a SplitTile, the parent zoom tile is built and passed up in turn
+	void finishTask(const TileTask& task, bool used, RenderJob& rj);
+
+	// get the image a task should render into
+	RGBAImage& getOutput(const TileTask& task);
+
+	void printStats() const;
+
+private:
+	bool stealTasks(int thread);
+	void wakeIdle();
+};
+
+
+#endif // SCHEDULER_H
@@ -0,0 +1,243 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+#include "shard.h"
+#include "utils.h"
+
+using namespace std;
+
+
+#define SHARDFILEMAGIC "pigmapshard3"
+
+struct fcloser
+{
+	FILE *f;
+	fcloser(FILE *ff) : f(ff) {}
+	~fcloser() {fclose(f);}
+};
+
+// file header, after the magic string (native byte order; the file is only meant to be read by the
+//  same build of pigmap, possibly on another machine of the same type)
+struct ShardFileHeader
+{
+	int32_t B, T, baseZoom;
+	int32_t zoom, shard, numshards;
+	int32_t fullrender;
+	uint32_t paramshash;  // shardParamsHash when the file was written
+	int32_t hasmanifest;  // whether a world manifest follows the images
+	int32_t count;  // number of images that follow, each preceded by its x and y as int32s
+};
+
+
+
+bool ShardSpec::parse(const string& s)
+{
+	int k, n;
+	char slash;
+	istringstream ss(s);
+	if (!(ss >> k >> slash >> n) || slash != '/' || !ss.eof())
+		return false;
+	if (n < 1 || k < 1 || k > n)
+		return false;
+	shard = k - 1;
+	numshards = n;
+	return true;
+}
+
+void ShardSpec::chooseZoom(const MapParams& mp)
+{
+	if (zoom != -1)
+		return;
+	for (zoom = 1; zoom < mp.baseZoom && ((int64_t)1 << (2 * zoom)) < 16 * numshards; zoom++)
+		;
+}
+
+bool ShardSpec::contains(const ZoomTileIdx& zti, const MapParams& mp) const
+{
+	if (!active())
+		return true;
+	ZoomTileIdx z = zti.toZoom(zoom);
+	// scatter the zoom tiles between the shards, so that each one gets some dense areas and some
+	//  sparse ones
+	uint64_t h = (uint64_t)z.x * 0x9e3779b97f4a7c15ULL ^ (uint64_t)z.y * 0xc2b2ae3d27d4eb4fULL;
+	h ^= h >> 29;
+	return (int)(h % numshards) == shard;
+}
+
+string shardFilePath(const string& outputpath, int shard, int numshards)
+{
+	return outputpath + "/shards/" + tostring(shard + 1) + "-of-" + tostring(numshards) + ".dat";
+}
+
+uint32_t shardParamsHash(const MapParams& mp, const ShardSpec& spec)
+{
+	// (FNV-1a over the values)
+	int32_t values[8] = {mp.B, mp.T, mp.baseZoom, mp.minY, mp.maxY, (int32_t)mp.mode, spec.zoom, spec.numshards};
+	uint32_t h = 2166136261u;
+	const uint8_t *p = (const uint8_t*)values;
+	for (size_t i = 0; i < sizeof(values); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+bool writeShardFile(const string& outputpath, const ShardSpec& spec, const MapParams& mp, bool fullrender,
+                    const ThreadOutputCache *tocache, const WorldManifest *manifest)
+{
+	string filename = shardFilePath(outputpath, spec.shard, spec.numshards);
+	string tempname = filename + ".tmp";
+	makePath(outputpath + "/shards");
+	{
+		FILE *f = fopen(tempname.c_str(), "wb");
+		if (f == NULL)
+			return false;
+		fcloser fc(f);
+
+		ShardFileHeader hdr;
+		hdr.B = mp.B;
+		hdr.T = mp.T;
+		hdr.baseZoom = mp.baseZoom;
+		hdr.zoom = spec.zoom;
+		hdr.shard = spec.shard;
+		hdr.numshards = spec.numshards;
+		hdr.fullrender = fullrender;
+		hdr.paramshash = shardParamsHash(mp, spec);
+		hdr.hasmanifest = manifest != NULL;
+		hdr.count = 0;
+		if (tocache != NULL)
+			for (size_t i = 0; i < tocache->used.size(); i++)
+				if (tocache->used[i])
+					hdr.count++;
+		if (1 != fwrite(SHARDFILEMAGIC, sizeof(SHARDFILEMAGIC), 1, f) || 1 != fwrite(&hdr, sizeof(hdr), 1, f))
+			return false;
+
+		for (int64_t idx = 0; tocache != NULL && idx < (int64_t)tocache->used.size(); idx++)
+		{
+			if (!tocache->used[idx])
+				continue;
+			int64_t size = 1 << tocache->zoom;
+			int32_t xy[2] = {(int32_t)(idx % size), (int32_t)(idx / size)};
+			RGBAImage buf;
+			const RGBAImage *img = tocache->getImage(idx, buf);
+			if (img == NULL || img->w != mp.tileSize() || img->h != mp.tileSize())
+				return false;
+			if (1 != fwrite(xy, sizeof(xy), 1, f) || 1 != fwrite(&img->data[0], img->data.size() * sizeof(RGBAPixel), 1, f))
+				return false;
+		}
+		if (manifest != NULL && !manifest->write(f))
+			return false;
+		if (0 != fflush(f) || ferror(f))
+			return false;
+	}
+	renameFile(tempname, filename);
+	return true;
+}
+
+int readShardHeader(FILE *f, ShardFileHeader& hdr)
+{
+	char magic[sizeof(SHARDFILEMAGIC)];
+	if (1 != fread(magic, sizeof(magic), 1, f) || 0 != memcmp(magic, SHARDFILEMAGIC, sizeof(magic)) ||
+	    1 != fread(&hdr, sizeof(hdr), 1, f))
+		return -2;
+	if (hdr.numshards < 1 || hdr.shard < 0 || hdr.shard >= hdr.numshards || hdr.count < 0)
+		return -2;
+	return 0;
+}
+
+int readShardHeader(const string& filename, ShardSpec& spec)
+{
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return -1;
+	fcloser fc(f);
+	ShardFileHeader hdr;
+	if (0 != readShardHeader(f, hdr))
+		return -2;
+	spec.shard = hdr.shard;
+	spec.numshards = hdr.numshards;
+	spec.zoom = hdr.zoom;
+	return 0;
+}
+
+int readShardFile(const string& filename, const MapParams& mp, ShardSpec& spec, bool& fullrender,
+                  ThreadOutputCache& tocache, WorldManifest& manifest, bool& hasmanifest)
+{
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return -1;
+	fcloser fc(f);
+	ShardFileHeader hdr;
+	if (0 != readShardHeader(f, hdr))
+		return -2;
+	if (hdr.B != mp.B || hdr.T != mp.T || hdr.baseZoom != mp.baseZoom || hdr.zoom != tocache.zoom)
+		return -2;
+	spec.shard = hdr.shard;
+	spec.numshards = hdr.numshards;
+	spec.zoom = hdr.zoom;
+	if (hdr.paramshash != shardParamsHash(mp, spec))
+		return -2;
+	fullrender = hdr.fullrender;
+
+	int64_t size = 1 << tocache.zoom;
+	for (int32_t i = 0; i < hdr.count; i++)
+	{
+		int32_t xy[2];
+		if (1 != fread(xy, sizeof(xy), 1, f) || xy[0] < 0 || xy[0] >= size || xy[1] < 0 || xy[1] >= size)
+			return -2;
+		int idx = tocache.getIndex(ZoomTileIdx(xy[0], xy[1], tocache.zoom));
+		RGBAImage& img = tocache.images[idx];
+		img.create(mp.tileSize(), mp.tileSize());
+		if (1 != fread(&img.data[0], img.data.size() * sizeof(RGBAPixel), 1, f))
+			return -2;
+		tocache.store(idx, true);
+	}
+	hasmanifest = hdr.hasmanifest;
+	if (hasmanifest && !manifest.read(f))
+		return -2;
+	return 0;
+}
+
+// parse the shard and count from a handoff file's path
+bool parseShardFilePath(const string& path, int& shard, int& numshards)
+{
+	string::size_type slash = path.rfind('/');
+	string name = (slash == string::npos) ? path : path.substr(slash + 1);
+	char tail[8];
+	return 3 == sscanf(name.c_str(), "%d-of-%d%7s", &shard, &numshards, tail) && 0 == strcmp(tail, ".dat") &&
+	       numshards >= 1 && shard >= 1 && shard <= numshards;
+}
+
+vector<string> listShardFiles(const string& outputpath)
+{
+	vector<string> entries, files;
+	listEntries(outputpath + "/shards", entries);
+	int shard, numshards;
+	for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); it++)
+		if (parseShardFilePath(*it, shard, numshards))
+			files.push_back(*it);
+	return files;
+}
+
+void removeStaleShardFiles(const string& outputpath, const ShardSpec& spec)
+{
+	vector<string> files = listShardFiles(outputpath);
+	int shard, numshards;
+	for (vector<string>::const_iterator it = files.begin(); it != files.end(); it++)
+		if (parseShardFilePath(*it, shard, numshards) && (numshards != spec.numshards || shard == spec.shard + 1))
+			remove(it->c_str());
+}
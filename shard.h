@@ -0,0 +1,87 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "map.h"
+#include "render.h"
+#include "manifest.h"
+
+
+// a render can be split into shards (run by separate processes, possibly on separate machines sharing
+//  the output path): the zoom tiles at the shard zoom level are divided between the shards, and each shard
+//  renders everything beneath its own zoom tiles, then saves the zoom tile images themselves into a
+//  handoff file; a final merge step reads all the handoff files and builds the zoom levels above
+struct ShardSpec
+{
+	int shard;  // which shard this is, 0 to numshards-1
+	int numshards;  // 0 if we're not sharding
+	int zoom;  // zoom level at which the map is divided up (-1 to choose automatically)
+
+	ShardSpec() : shard(0), numshards(0), zoom(-1) {}
+
+	bool active() const {return numshards > 0;}
+
+	// parse "k/N" (with k counted from 1, as the user sees it)
+	bool parse(const std::string& s);
+
+	// pick the shard zoom level, if the user didn't: a level with at least 16 zoom tiles per shard
+	//  (or the base zoom level, if that comes first)
+	// ...the choice only depends on the shard count and the map params, so all the shards agree
+	void chooseZoom(const MapParams& mp);
+
+	// whether a base tile or zoom tile (at or below the shard zoom level) belongs to this shard
+	bool contains(const ZoomTileIdx& zti, const MapParams& mp) const;
+	bool contains(const TileIdx& ti, const MapParams& mp) const {return contains(ti.toZoomTileIdx(mp), mp);}
+};
+
+// path of the handoff file for a shard (shard is counted from 0)
+std::string shardFilePath(const std::string& outputpath, int shard, int numshards);
+
+// hash of everything the shards of one render must agree on (the map params, plus the shard count and
+//  zoom level); stored in each handoff file, so the merge can reject files left over from another render
+uint32_t shardParamsHash(const MapParams& mp, const ShardSpec& spec);
+
+// write the used images from a ThreadOutputCache at the shard zoom level to this shard's handoff file,
+//  along with the shard's world manifest (only the merge knows when the whole map is done, so it writes
+//  pigmap.manifest from the ones in the handoff files)
+// ...tocache may be NULL, for a shard that had nothing to render; manifest is NULL if the world isn't
+//  in region format
+bool writeShardFile(const std::string& outputpath, const ShardSpec& spec, const MapParams& mp, bool fullrender,
+                    const ThreadOutputCache *tocache, const WorldManifest *manifest);
+
+// read a handoff file into a ThreadOutputCache (which must be at the right zoom level), checking that it
+//  matches the map params; returns the shard info, render type, and manifest (if there is one) from the file
+// ...returns 0 on success, -1 if the file is missing, -2 if it's corrupt or doesn't match
+int readShardFile(const std::string& filename, const MapParams& mp, ShardSpec& spec, bool& fullrender,
+                  ThreadOutputCache& tocache, WorldManifest& manifest, bool& hasmanifest);
+
+// read just the shard info from a handoff file, to find out the shard zoom level and count
+int readShardHeader(const std::string& filename, ShardSpec& spec);
+
+// list the handoff files in the output path
+std::vector<std::string> listShardFiles(const std::string& outputpath);
+
+// before a shard renders: delete its old handoff file, along with any left by a render with a different
+//  number of shards, so that if this one fails, the merge won't find anything stale
+void removeStaleShardFiles(const std::string& outputpath, const ShardSpec& spec);
+
+
+#endif // SHARD_H
@@ -31,13 +31,6 @@ void ChunkGroup::setRequired(const PosChunkIdx& ci)
 	chunksets[csi]->setRequired(ci);
 }
 
-void ChunkGroup::setDiskState(const PosChunkIdx& ci, int state)
-{
-	int csi = chunkSetIdx(ci);
-	if (chunksets[csi] == NULL)
-		chunksets[csi] = new ChunkSet;
-	chunksets[csi]->setDiskState(ci, state);
-}
 
 
 
@@ -64,32 +57,34 @@ void ChunkTable::setRequired(const PosChunkIdx& ci)
 
 void ChunkTable::setDiskState(const PosChunkIdx& ci, int state)
 {
-	int cgi = chunkGroupIdx(ci);
-	if (chunkgroups[cgi] == NULL)
-		chunkgroups[cgi] = new ChunkGroup;
-	chunkgroups[cgi]->setDiskState(ci, state);
-}
-
-void ChunkTable::copyFrom(const ChunkTable& ctable)
-{
-	for (int cgi = 0; cgi < CTLEVEL3SIZE*CTLEVEL3SIZE; cgi++)
+	// chunks that aren't required may not have a set yet; other threads may be reading the
+	//  pointers while we create one, so make sure it's fully built before it's visible
+	ChunkSet *cs = getChunkSet(ci);
+	if (cs == NULL)
 	{
-		if (ctable.chunkgroups[cgi] != NULL)
+		mutexLocker ml(allocmutex);
+		int cgi = chunkGroupIdx(ci);
+		if (chunkgroups[cgi] == NULL)
 		{
-			chunkgroups[cgi] = new ChunkGroup;
-			for (int csi = 0; csi < CTLEVEL2SIZE*CTLEVEL2SIZE; csi++)
-			{
-				if (ctable.chunkgroups[cgi]->chunksets[csi] != NULL)
-				{
-					chunkgroups[cgi]->chunksets[csi] = new ChunkSet(*(ctable.chunkgroups[cgi]->chunksets[csi]));
-				}
-			}
+			ChunkGroup *cg = new ChunkGroup;
+			__sync_synchronize();
+			chunkgroups[cgi] = cg;
 		}
+		int csi = chunkgroups[cgi]->chunkSetIdx(ci);
+		if (chunkgroups[cgi]->chunksets[csi] == NULL)
+		{
+			ChunkSet *newcs = new ChunkSet;
+			__sync_synchronize();
+			chunkgroups[cgi]->chunksets[csi] = newcs;
+		}
+		cs = chunkgroups[cgi]->chunksets[csi];
 	}
+	cs->setDiskState(ci, state);
 }
 
 
 
+
 RequiredChunkIterator::RequiredChunkIterator(ChunkTable& ctable) : current(-1,-1), chunktable(ctable)
 {
 	// if the very first chunk is required, use it
@@ -150,14 +145,6 @@ bool TileGroup::setRequired(const PosTileIdx& ti)
 	return prevset;
 }
 
-void TileGroup::setDrawn(const PosTileIdx& ti)
-{
-	int tsi = tileSetIdx(ti);
-	if (tilesets[tsi] == NULL)
-		tilesets[tsi] = new TileSet;
-	tilesets[tsi]->setDrawn(ti);
-}
-
 PosTileIdx TileTable::toPosTileIdx(int tgi, int tsi, int bi)
 {
 	PosTileIdx ti(0,0);
@@ -181,12 +168,16 @@ bool TileTable::setRequired(const PosTileIdx& ti)
 	return prevset;
 }
 
-void TileTable::setDrawn(const PosTileIdx& ti)
+bool TileTable::setDrawn(const PosTileIdx& ti)
 {
-	int tgi = tileGroupIdx(ti);
-	if (tilegroups[tgi] == NULL)
-		tilegroups[tgi] = new TileGroup;
-	tilegroups[tgi]->setDrawn(ti);
+	// required tiles always have a set already, so we never have to create one here
+	TileSet *ts = getTileSet(ti);
+	if (ts == NULL)
+	{
+		cerr << "attempted to set drawn flag on tile with no TileSet!" << endl;
+		return true;
+	}
+	return ts->setDrawn(ti);
 }
 
 bool TileTable::reject(const ZoomTileIdx& zti, const MapParams& mp) const
@@ -261,23 +252,7 @@ int64_t TileTable::getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) c
 	return count;
 }
 
-void TileTable::copyFrom(const TileTable& ttable)
-{
-	for (int tgi = 0; tgi < TTLEVEL3SIZE*TTLEVEL3SIZE; tgi++)
-	{
-		if (ttable.tilegroups[tgi] != NULL)
-		{
-			tilegroups[tgi] = new TileGroup;
-			for (int tsi = 0; tsi < TTLEVEL2SIZE*TTLEVEL2SIZE; tsi++)
-			{
-				if (ttable.tilegroups[tgi]->tilesets[tsi] != NULL)
-				{
-					tilegroups[tgi]->tilesets[tsi] = new TileSet(*(ttable.tilegroups[tgi]->tilesets[tsi]));
-				}
-			}
-		}
-	}
-}
+
 
 
 
@@ -376,14 +351,6 @@ void RegionGroup::setRequired(const PosRegionIdx& ri)
 	regionsets[rsi]->setRequired(ri);
 }
 
-void RegionGroup::setDiskState(const PosRegionIdx& ri, int state)
-{
-	int rsi = regionSetIdx(ri);
-	if (regionsets[rsi] == NULL)
-		regionsets[rsi] = new RegionSet;
-	regionsets[rsi]->setDiskState(ri, state);
-}
-
 PosRegionIdx RegionTable::toPosRegionIdx(int rgi, int rsi, int bi)
 {
 	PosRegionIdx ri(0,0);
@@ -406,26 +373,26 @@ void RegionTable::setRequired(const PosRegionIdx& ri)
 
 void RegionTable::setDiskState(const PosRegionIdx& ri, int state)
 {
-	int rgi = regionGroupIdx(ri);
-	if (regiongroups[rgi] == NULL)
-		regiongroups[rgi] = new RegionGroup;
-	regiongroups[rgi]->setDiskState(ri, state);
-}
-
-void RegionTable::copyFrom(const RegionTable& rtable)
-{
-	for (int rgi = 0; rgi < RTLEVEL3SIZE*RTLEVEL3SIZE; rgi++)
+	// see ChunkTable::setDiskState
+	RegionSet *rs = getRegionSet(ri);
+	if (rs == NULL)
 	{
-		if (rtable.regiongroups[rgi] != NULL)
+		mutexLocker ml(allocmutex);
+		int rgi = regionGroupIdx(ri);
+		if (regiongroups[rgi] == NULL)
 		{
-			regiongroups[rgi] = new RegionGroup;
-			for (int rsi = 0; rsi < RTLEVEL2SIZE*RTLEVEL2SIZE; rsi++)
-			{
-				if (rtable.regiongroups[rgi]->regionsets[rsi] != NULL)
-				{
-					regiongroups[rgi]->regionsets[rsi] = new RegionSet(*(rtable.regiongroups[rgi]->regionsets[rsi]));
-				}
-			}
+			RegionGroup *rg = new RegionGroup;
+			__sync_synchronize();
+			regiongroups[rgi] = rg;
+		}
+		int rsi = regiongroups[rgi]->regionSetIdx(ri);
+		if (regiongroups[rgi]->regionsets[rsi] == NULL)
+		{
+			RegionSet *newrs = new RegionSet;
+			__sync_synchronize();
+			regiongroups[rgi]->regionsets[rsi] = newrs;
 		}
+		rs = regiongroups[rgi]->regionsets[rsi];
 	}
+	rs->setDiskState(ri, state);
 }
@@ -19,14 +19,16 @@
 #define TABLES_H
 
 #include <bitset>
+#include <algorithm>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "map.h"
 #include "utils.h"
 
 
 
-#define CTDATASIZE 3
+#define CTDATASIZE 1
 
 #define CTLEVEL1BITS 5
 #define CTLEVEL2BITS 5
@@ -45,6 +47,29 @@
 #define CTGETLEVEL2(a) ((a & CTLEVEL2MASK) >> CTLEVEL1BITS)
 #define CTGETLEVEL3(a) (((a & CTLEVEL3MASK) >> CTLEVEL2BITS) >> CTLEVEL1BITS)
 
+
+// the required bits in the tables are only set before rendering starts, but the disk states and drawn
+//  flags are changed by the render threads as they go, so they're kept in separate arrays of words
+//  that are only modified atomically
+// ...get/set 2-bit fields within such an array
+inline int getSharedState(const uint32_t *words, size_t idx)
+{
+	// (an atomic read, since other threads may be changing the word; the add of 0 doesn't change it)
+	uint32_t word = __sync_fetch_and_add(const_cast<uint32_t*>(words + idx / 16), 0);
+	return (word >> ((idx % 16) * 2)) & 0x3;
+}
+inline void setSharedState(uint32_t *words, size_t idx, int state)
+{
+	uint32_t *word = words + idx / 16;
+	int shift = (idx % 16) * 2;
+	uint32_t oldval, newval;
+	do
+	{
+		oldval = *(volatile uint32_t*)word;
+		newval = (oldval & ~(0x3 << shift)) | ((state & 0x3) << shift);
+	} while (!__sync_bool_compare_and_swap(word, oldval, newval));
+}
+
 // variation of ChunkIdx for use with the ChunkTable: translates so that all coords are positive
 // ...can also be used to check for the map being too big
 struct PosChunkIdx
@@ -64,11 +89,11 @@ struct PosChunkIdx
 //  whether it's even present on disk, etc.
 struct ChunkSet
 {
-	// each chunk gets 3 bits:
-	//  -first bit is 1 for required (must be drawn), 0 for not required
-	//  -last two bits describe state of chunk on disk:
+	// each chunk gets a bit that is 1 for required (must be drawn), 0 for not required, plus two bits
+	//  (in diskstates) that describe the state of the chunk on disk:
 	//    00: have not tried to find chunk on disk yet
-	//    01: have successfully read chunk from disk (i.e. it should be in the cache, if we still need it)
+	//    01: chunk has been read successfully at least once (the ChunkCache keeps track of which
+	//        chunks it still holds itself)
 	//    10: chunk does not exist on disk
 	//    11: chunk file is corrupted
 	static const int CHUNK_UNKNOWN = 0;
@@ -76,11 +101,15 @@ struct ChunkSet
 	static const int CHUNK_MISSING = 2;
 	static const int CHUNK_CORRUPTED = 3;
 	std::bitset<CTLEVEL1SIZE*CTLEVEL1SIZE*CTDATASIZE> bits;
+	uint32_t diskstates[CTLEVEL1SIZE*CTLEVEL1SIZE/16];  // see getSharedState/setSharedState
+
+	ChunkSet() {std::fill(diskstates, diskstates + CTLEVEL1SIZE*CTLEVEL1SIZE/16, 0);}
 
 	size_t bitIdx(const PosChunkIdx& ci) const {return (CTGETLEVEL1(ci.z) * CTLEVEL1SIZE + CTGETLEVEL1(ci.x)) * CTDATASIZE;}
 
 	void setRequired(const PosChunkIdx& ci) {bits.set(bitIdx(ci));}
-	void setDiskState(const PosChunkIdx& ci, int state) {size_t bi = bitIdx(ci); bits[bi+1] = state & 0x2; bits[bi+2] = state & 0x1;}
+	int getDiskState(const PosChunkIdx& ci) const {return getSharedState(diskstates, bitIdx(ci) / CTDATASIZE);}
+	void setDiskState(const PosChunkIdx& ci, int state) {setSharedState(diskstates, bitIdx(ci) / CTDATASIZE, state);}
 };
 
 // first level of indirection: information about a 32x32 group of ChunkSets, and hence a 1024x1024 set of chunks
@@ -96,16 +125,17 @@ struct ChunkGroup
 	ChunkSet* getChunkSet(const PosChunkIdx& ci) const {return chunksets[chunkSetIdx(ci)];}
 
 	void setRequired(const PosChunkIdx& ci);
-	void setDiskState(const PosChunkIdx& ci, int state);
 };
 
 // second (and final) level of indirection: 256x256 groups, so 262144x262144 possible chunks
+// ...a single table is shared by all the render threads; setDiskState may be called by any of them
 struct ChunkTable : private nocopy
 {
 	ChunkGroup *chunkgroups[CTLEVEL3SIZE*CTLEVEL3SIZE];
+	pthread_mutex_t allocmutex;  // held while creating groups/sets during rendering
 
-	ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) chunkgroups[i] = NULL;}
-	~ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) delete chunkgroups[i];}
+	ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) chunkgroups[i] = NULL; pthread_mutex_init(&allocmutex, NULL);}
+	~ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) delete chunkgroups[i]; pthread_mutex_destroy(&allocmutex);}
 
 	int chunkGroupIdx(const PosChunkIdx& ci) const {return CTGETLEVEL3(ci.z) * CTLEVEL3SIZE + CTGETLEVEL3(ci.x);}
 	ChunkGroup* getChunkGroup(const PosChunkIdx& ci) const {return chunkgroups[chunkGroupIdx(ci)];}
@@ -127,17 +157,12 @@ struct ChunkTable : private nocopy
 	int getDiskState(const PosChunkIdx& ci) const
 	{
 		if (ChunkSet *cs = getChunkSet(ci))
-		{
-			int bitIdx = cs->bitIdx(ci);
-			return (cs->bits[bitIdx+1] << 1) | cs->bits[bitIdx+2];
-		}
+			return cs->getDiskState(ci);
 		return 0;
 	}
 
-	void setRequired(const PosChunkIdx& ci);
+	void setRequired(const PosChunkIdx& ci);  // only before rendering starts
 	void setDiskState(const PosChunkIdx& ci, int state);
-
-	void copyFrom(const ChunkTable& ctable);
 };
 
 
@@ -167,7 +192,7 @@ struct RequiredChunkIterator
 
 
 
-#define TTDATASIZE 2
+#define TTDATASIZE 1
 
 #define TTLEVEL1BITS 4
 #define TTLEVEL2BITS 4
@@ -204,17 +229,22 @@ struct PosTileIdx
 // structure to hold information about a 16x16 set of tiles: for each tile, whether it's been drawn yet
 struct TileSet
 {
-	// each tile gets two bits: first is whether it's required, second is whether it's been drawn
+	// each tile gets a bit for whether it's required, plus one (in drawn) for whether it's been drawn
 	std::bitset<TTLEVEL1SIZE*TTLEVEL1SIZE*TTDATASIZE> bits;
+	uint32_t drawn[TTLEVEL1SIZE*TTLEVEL1SIZE/32];  // only modified atomically
+
+	TileSet() {std::fill(drawn, drawn + TTLEVEL1SIZE*TTLEVEL1SIZE/32, 0);}
 
 	size_t bitIdx(const PosTileIdx& ti) const {return (TTGETLEVEL1(ti.y) * TTLEVEL1SIZE + TTGETLEVEL1(ti.x)) * TTDATASIZE;}
 
 	// assumes that ti actually belongs to this set
 	bool isRequired(const PosTileIdx& ti) const {return bits[bitIdx(ti)];}
+	bool isDrawn(const PosTileIdx& ti) const {size_t bi = bitIdx(ti) / TTDATASIZE; return (*(volatile const uint32_t*)(drawn + bi / 32) >> (bi % 32)) & 0x1;}
 
 	// set tile's required bit and return previous state of bit
 	bool setRequired(const PosTileIdx& ti) {size_t bi = bitIdx(ti); bool rv = bits[bi]; bits.set(bi); return rv;}
-	void setDrawn(const PosTileIdx& ti) {bits.set(bitIdx(ti)+1);}
+	// set tile's drawn bit and return previous state of bit
+	bool setDrawn(const PosTileIdx& ti) {size_t bi = bitIdx(ti) / TTDATASIZE; return (__sync_fetch_and_or(drawn + bi / 32, 1u << (bi % 32)) >> (bi % 32)) & 0x1;}
 };
 
 // first level of indirection: information about a 256x256 set of tiles
@@ -233,10 +263,10 @@ struct TileGroup
 	TileSet* getTileSet(const PosTileIdx& ti) const {return tilesets[tileSetIdx(ti)];}
 
 	bool setRequired(const PosTileIdx& ti);  // set tile's required bit and return previous state of bit
-	void setDrawn(const PosTileIdx& ti);
 };
 
 // second (and final) level of indirection: a 65536x65536 set of tiles
+// ...a single table is shared by all the render threads, which set the drawn flags as they go
 struct TileTable : private nocopy
 {
 	TileGroup *tilegroups[TTLEVEL3SIZE*TTLEVEL3SIZE];
@@ -254,18 +284,19 @@ struct TileTable : private nocopy
 	static PosTileIdx toPosTileIdx(int tgi, int tsi, int bi);
 	
 	bool isRequired(const PosTileIdx& ti) const {TileSet *ts = getTileSet(ti); return (ts == NULL) ? false : ts->bits[ts->bitIdx(ti)];}
-	bool isDrawn(const PosTileIdx& ti) const {TileSet *ts = getTileSet(ti); return (ts == NULL) ? false : ts->bits[ts->bitIdx(ti)+1];}
+	bool isDrawn(const PosTileIdx& ti) const {TileSet *ts = getTileSet(ti); return (ts == NULL) ? false : ts->isDrawn(ti);}
 
-	bool setRequired(const PosTileIdx& ti);  // set tile's required bit and return previous state of bit
-	void setDrawn(const PosTileIdx& ti);
+	// set tile's required bit and return previous state of bit (only before rendering starts)
+	bool setRequired(const PosTileIdx& ti);
+	// set a required tile's drawn bit and return previous state of bit; safe to call from multiple threads,
+	//  so exactly one caller will get false
+	bool setDrawn(const PosTileIdx& ti);
 
 	// see if an entire zoom tile can be rejected because its TileGroup or TileSet is NULL
 	bool reject(const ZoomTileIdx& zti, const MapParams& mp) const;
 
 	// get the total number of base tiles required to draw a zoom tile
 	int64_t getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) const;
-
-	void copyFrom(const TileTable& ttable);
 };
 
 
@@ -307,7 +338,7 @@ struct TileGroupIterator
 
 
 
-#define RTDATASIZE 3
+#define RTDATASIZE 1
 
 #define RTLEVEL1BITS 4
 #define RTLEVEL2BITS 4
@@ -341,11 +372,11 @@ struct PosRegionIdx
 
 struct RegionSet
 {
-	// each region gets 3 bits:
-	//  -first bit is 1 for required (must be drawn), 0 for not required
-	//  -last two bits describe state of region on disk:
-	//    00: have not tried to find region on disk yet
-	//    01: have successfully read region from disk (i.e. it should be in the cache, if we still need it)
+	// each region gets a bit that is 1 for required (must be drawn), 0 for not required, plus two bits
+	//  (in diskstates) that describe the state of the region on disk:
+	//    00: have not tried to find region on disk yet (or have read it successfully--each RegionCache
+	//        keeps track of which regions it holds itself)
+	//    01: unused in the table
 	//    10: region does not exist on disk
 	//    11: region file is corrupted
 	static const int REGION_UNKNOWN = 0;
@@ -353,11 +384,15 @@ struct RegionSet
 	static const int REGION_MISSING = 2;
 	static const int REGION_CORRUPTED = 3;
 	std::bitset<RTLEVEL1SIZE*RTLEVEL1SIZE*RTDATASIZE> bits;
+	uint32_t diskstates[RTLEVEL1SIZE*RTLEVEL1SIZE/16];  // see getSharedState/setSharedState
+
+	RegionSet() {std::fill(diskstates, diskstates + RTLEVEL1SIZE*RTLEVEL1SIZE/16, 0);}
 
 	size_t bitIdx(const PosRegionIdx& ri) const {return (RTGETLEVEL1(ri.z) * RTLEVEL1SIZE + RTGETLEVEL1(ri.x)) * RTDATASIZE;}
 
 	void setRequired(const PosRegionIdx& ri) {bits.set(bitIdx(ri));}
-	void setDiskState(const PosRegionIdx& ri, int state) {size_t bi = bitIdx(ri); bits[bi+1] = state & 0x2; bits[bi+2] = state & 0x1;}
+	int getDiskState(const PosRegionIdx& ri) const {return getSharedState(diskstates, bitIdx(ri) / RTDATASIZE);}
+	void setDiskState(const PosRegionIdx& ri, int state) {setSharedState(diskstates, bitIdx(ri) / RTDATASIZE, state);}
 };
 
 struct RegionGroup
@@ -371,15 +406,16 @@ struct RegionGroup
 	RegionSet* getRegionSet(const PosRegionIdx& ri) const {return regionsets[regionSetIdx(ri)];}
 
 	void setRequired(const PosRegionIdx& ri);
-	void setDiskState(const PosRegionIdx& ri, int state);
 };
 
+// ...a single table is shared by all the render threads; setDiskState may be called by any of them
 struct RegionTable : private nocopy
 {
 	RegionGroup *regiongroups[RTLEVEL3SIZE*RTLEVEL3SIZE];
+	pthread_mutex_t allocmutex;  // held while creating groups/sets during rendering
 
-	RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) regiongroups[i] = NULL;}
-	~RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) if (regiongroups[i] != NULL) delete regiongroups[i];}
+	RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) regiongroups[i] = NULL; pthread_mutex_init(&allocmutex, NULL);}
+	~RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) if (regiongroups[i] != NULL) delete regiongroups[i]; pthread_mutex_destroy(&allocmutex);}
 
 	int regionGroupIdx(const PosRegionIdx& ri) const {return RTGETLEVEL3(ri.z) * RTLEVEL3SIZE + RTGETLEVEL3(ri.x);}
 	RegionGroup* getRegionGroup(const PosRegionIdx& ri) const {return regiongroups[regionGroupIdx(ri)];}
@@ -389,12 +425,10 @@ struct RegionTable : private nocopy
 	static PosRegionIdx toPosRegionIdx(int rgi, int rsi, int bi);
 	
 	bool isRequired(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? false : rs->bits[rs->bitIdx(ri)];}
-	int getDiskState(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? 0 : ((rs->bits[rs->bitIdx(ri)+1] ? 0x2 : 0) | (rs->bits[rs->bitIdx(ri)+2] ? 0x1 : 0));}
+	int getDiskState(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? 0 : rs->getDiskState(ri);}
 
-	void setRequired(const PosRegionIdx& ri);
+	void setRequired(const PosRegionIdx& ri);  // only before rendering starts
 	void setDiskState(const PosRegionIdx& ri, int state);
-
-	void copyFrom(const RegionTable& rtable);
 };
 
 
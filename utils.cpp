@@ -24,6 +24,8 @@
 #include <iostream>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -110,6 +112,22 @@ uint64_t getHeapUsage()
 #endif
 }
 
+uint64_t getPhysicalMemory()
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pagesize <= 0)
+		return 0;
+	return (uint64_t)pages * (uint64_t)pagesize;
+}
+
+int64_t getMicroseconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 
 struct gzCloser
 {
@@ -209,6 +227,67 @@ bool readGzOrZlib(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
 	return true;
 }
 
+Inflater::~Inflater()
+{
+	if (zstr != NULL)
+	{
+		inflateEnd(zstr);
+		delete zstr;
+	}
+}
+
+bool Inflater::decompress(uint8_t *inbuf, size_t size, vector<uint8_t>& data)
+{
+	// set up the stream the first time; after that, just reset it
+	if (zstr == NULL)
+	{
+		zstr = new z_stream;
+		zstr->next_in = Z_NULL;
+		zstr->avail_in = 0;
+		zstr->zalloc = Z_NULL;
+		zstr->zfree = Z_NULL;
+		zstr->opaque = Z_NULL;
+		if (inflateInit2(zstr, 15 + 32) != Z_OK)  // adding 32 to window size means "detect both gzip and zlib"
+		{
+			delete zstr;
+			zstr = NULL;
+			return false;
+		}
+	}
+	else if (inflateReset2(zstr, 15 + 32) != Z_OK)
+		return false;
+
+	// guess the output size from the ratio so far, plus a bit, so we can usually finish in one go; if the
+	//  vector already has more room than that, use it all
+	size_t estimate = (totalin > 0) ? (size_t)((double)size * totalout / totalin * 1.25) + 4096 : 131072;
+	data.resize(max(estimate, data.capacity()));
+	data.resize(data.capacity());  // just in case extra space was allocated
+	zstr->next_in = inbuf;
+	zstr->avail_in = size;
+	zstr->next_out = &(data[0]);
+	zstr->avail_out = data.size();
+	int result = inflate(zstr, Z_FINISH);
+	while (result != Z_STREAM_END)
+	{
+		// if we stopped for any reason other than running out of room, abort
+		if ((result != Z_OK && result != Z_BUF_ERROR) || zstr->avail_out != 0)
+			return false;
+		// otherwise, reallocate and keep going
+		ptrdiff_t diff = zstr->next_out - &(data[0]);
+		size_t addedsize = data.size();
+		data.resize(data.size() + addedsize);
+		data.resize(data.capacity());  // just in case more was allocated
+		zstr->next_out = &(data[0]) + diff;
+		zstr->avail_out = data.size() - diff;
+		result = inflate(zstr, Z_FINISH);
+	}
+	// resize buffer back down to end of the actual data
+	data.resize(zstr->total_out);
+	totalin += size;
+	totalout += zstr->total_out;
+	return true;
+}
+
 
 
 uint32_t fromBigEndian(uint32_t i)
@@ -472,7 +551,7 @@ pair<int64_t, double> schedule(const vector<int64_t>& costs, vector<int>& assign
 	}
 
 	// compute error fraction
-	int mintotal = totals[0], maxtotal = totals[0];
+	int64_t mintotal = totals[0], maxtotal = totals[0];
 	for (int i = 1; i < threads; i++)
 	{
 		if (totals[i] < mintotal)
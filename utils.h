@@ -21,6 +21,7 @@
 #include <vector>
 #include <string>
 #include <stdint.h>
+#include <pthread.h>
 
 
 // ensure that a directory exists (create any missing directories on path)
@@ -45,6 +46,7 @@ int readGzFile(const std::string& filename, std::vector<uint8_t>& data);
 // extract gzip- or zlib-compressed data into a vector, overwriting its contents, and
 //  expanding it if necessary
 // (inbuf is not const only because zlib won't take const pointers for input)
+// ...this sets up a new zlib stream each time; to decompress many things, use an Inflater
 bool readGzOrZlib(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
 
 
@@ -52,6 +54,12 @@ bool readGzOrZlib(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
 
 uint64_t getHeapUsage();
 
+// total physical memory in the machine, or 0 if it can't be determined
+uint64_t getPhysicalMemory();
+
+// a monotonic clock, in microseconds, for timing things
+int64_t getMicroseconds();
+
 
 // convert a big-endian int into whatever the current platform endianness is
 uint32_t fromBigEndian(uint32_t i);
@@ -123,6 +131,15 @@ template <class T> struct arrayDeleter
 };
 
 
+// lock a mutex for the lifetime of the object
+struct mutexLocker
+{
+	pthread_mutex_t& mutex;
+	mutexLocker(pthread_mutex_t& m) : mutex(m) {pthread_mutex_lock(&mutex);}
+	~mutexLocker() {pthread_mutex_unlock(&mutex);}
+};
+
+
 template <class T> struct stackPusher
 {
 	std::vector<T>& vec;
@@ -131,6 +148,25 @@ template <class T> struct stackPusher
 };
 
 
+struct z_stream_s;
+
+// decompresses gzip or zlib data like readGzOrZlib, but keeps its zlib stream from one call to the next
+//  (resetting it rather than setting it up again), and sizes the output from the compression ratio it's
+//  seen so far, so that most things decompress in a single pass
+// ...not thread-safe; each thread should have its own
+struct Inflater : private nocopy
+{
+	z_stream_s *zstr;  // NULL until first used
+	int64_t totalin, totalout;  // bytes consumed and produced by all successful calls
+
+	Inflater() : zstr(NULL), totalin(0), totalout(0) {}
+	~Inflater();
+
+	// extract data into a vector, overwriting its contents, and expanding it if necessary
+	bool decompress(uint8_t* inbuf, size_t size, std::vector<uint8_t>& data);
+};
+
+
 // fast version for dividing by 16 (important for BlockIdx::getChunkIdx, which is called very very frequently)
 inline int64_t floordiv16(int64_t a)
 {
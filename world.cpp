@@ -18,6 +18,7 @@
 #include <iostream>
 #include <math.h>
 #include <fstream>
+#include <algorithm>
 
 #include "world.h"
 #include "region.h"
@@ -36,7 +37,7 @@ bool detectRegionFormat(const string& inputdir)
 
 
 
-bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, WorldManifest& manifest)
 {
 	bool findBaseZoom = mp.baseZoom == -1;
 	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
@@ -69,6 +70,7 @@ bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTa
 				cerr << "can't open region " << *it << " to list chunks" << endl;
 				continue;
 			}
+			manifest.set(ri, rfreader);
 			if (chunks.empty())
 				continue;
 			// mark the region required
@@ -129,7 +131,42 @@ bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTa
 	return true;
 }
 
-int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+// set a chunk that needs redrawing to required, along with its tiles; returns 0 on success, -1 if baseZoom
+//  is too small
+int setChunkRequired(const ChunkIdx& chunk, ChunkTable& chunktable, TileTable& tiletable, const MapParams& mp, int64_t& reqchunkcount)
+{
+	PosChunkIdx pci(chunk);
+	if (!pci.valid())
+	{
+		cerr << "ignoring extremely-distant chunk " << chunk.toFileName() << " (world may be corrupt)" << endl;
+		return 0;
+	}
+	if (chunktable.isRequired(pci))
+		return 0;
+	chunktable.setRequired(pci);
+	reqchunkcount++;
+	vector<TileIdx> tiles = chunk.getTiles(mp);
+	for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+	{
+		PosTileIdx pti(*tile);
+		if (pti.valid())
+			tiletable.setRequired(pti);
+		else
+		{
+			cerr << "ignoring extremely-distant tile [" << tile->x << "," << tile->y << "]" << endl;
+			cerr << "(world may be corrupt; is chunk " << chunk.toFileName() << " supposed to exist?)" << endl;
+			continue;
+		}
+		if (!tile->valid(mp))
+		{
+			cerr << "baseZoom too small!  can't fit tile [" << tile->x << "," << tile->y << "]" << endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, const WorldManifest& previous, WorldManifest& current)
 {
 	ifstream infile(regionlist.c_str());
 	if (infile.fail())
@@ -139,6 +176,7 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 	}
 	reqregioncount = 0;
 	RegionFileReader rfreader;
+	vector<ChunkIdx> chunks;
 	while (!infile.eof() && !infile.fail())
 	{
 		string regionfile;
@@ -156,54 +194,90 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 			}
 			if (regiontable.isRequired(pri))
 				continue;
-			vector<ChunkIdx> chunks;
-			if (0 != rfreader.getContainedChunks(ri, string84(inputdir), chunks))
+			int result = rfreader.loadHeaderOnly(ri, inputdir);
+			if (result == -1 && previous.regions.count(make_pair(ri.x, ri.z)) > 0)
+			{
+				// the region was there last time, but has been deleted; all its old chunks need redrawing
+				fill(rfreader.offsets.begin(), rfreader.offsets.end(), 0);
+				current.regions.erase(make_pair(ri.x, ri.z));
+			}
+			else if (result != 0)
 			{
 				cerr << "can't open region " << regionfile << " to list chunks" << endl;
 				continue;
 			}
+			else
+				current.set(ri, rfreader);
+			// only the chunks that differ from the last render need to be drawn (for a region that wasn't
+			//  in the manifest, that's all of them)
+			previous.getChangedChunks(ri, rfreader, chunks);
 			if (chunks.empty())
 				continue;
 			regiontable.setRequired(pri);
 			reqregioncount++;
 			for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
-			{
-				PosChunkIdx pci(*chunk);
-				if (pci.valid())
-				{
-					chunktable.setRequired(pci);
-					reqchunkcount++;
-				}
-				else
-				{
-					cerr << "ignoring extremely-distant chunk " << chunk->toFileName() << " (world may be corrupt)" << endl;
-					continue;
-				}
-				vector<TileIdx> tiles = chunk->getTiles(mp);
-				for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
-				{
-					PosTileIdx pti(*tile);
-					if (pti.valid())
-						tiletable.setRequired(pti);
-					else
-					{
-						cerr << "ignoring extremely-distant tile [" << tile->x << "," << tile->y << "]" << endl;
-						cerr << "(world may be corrupt; is region " << regionfile << " supposed to exist?)" << endl;
-						continue;
-					}
-					if (!tile->valid(mp))
-					{
-						cerr << "baseZoom too small!  can't fit tile [" << tile->x << "," << tile->y << "]" << endl;
-						return -1;
-					}
-				}
-			}
+				if (0 != setChunkRequired(*chunk, chunktable, tiletable, mp, reqchunkcount))
+					return -1;
 		}
 	}
 	reqtilecount = tiletable.reqcount;
 	return 0;
 }
 
+int findChangedChunks(const string& inputdir, const WorldManifest& previous, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, WorldManifest& current)
+{
+	reqregioncount = 0;
+	// go through all the region files, comparing their headers against the manifest
+	RegionFileReader rfreader;
+	vector<string> regionpaths;
+	listEntries(inputdir + "/region", regionpaths);
+	vector<ChunkIdx> chunks;
+	for (vector<string>::const_iterator it = regionpaths.begin(); it != regionpaths.end(); it++)
+	{
+		RegionIdx ri(0,0);
+		if (!RegionIdx::fromFilePath(*it, ri))
+			continue;
+		PosRegionIdx pri(ri);
+		if (!pri.valid())
+		{
+			cerr << "ignoring extremely-distant region " << *it << " (world may be corrupt)" << endl;
+			continue;
+		}
+		// we might have seen this region already, if the world data contains both .mca and .mcr files
+		if (current.regions.count(make_pair(ri.x, ri.z)) > 0)
+			continue;
+		if (0 != rfreader.loadHeaderOnly(ri, inputdir))
+		{
+			cerr << "can't open region " << *it << " to list chunks" << endl;
+			continue;
+		}
+		current.set(ri, rfreader);
+		previous.getChangedChunks(ri, rfreader, chunks);
+		if (chunks.empty())
+			continue;
+		regiontable.setRequired(pri);
+		reqregioncount++;
+		for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
+			if (0 != setChunkRequired(*chunk, chunktable, tiletable, mp, reqchunkcount))
+				return -1;
+	}
+
+	// the chunks in regions that have disappeared entirely also need to be redrawn (as nothing)
+	previous.getDeletedChunks(current, chunks);
+	for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
+	{
+		PosRegionIdx pri(chunk->getRegionIdx());
+		if (pri.valid() && !regiontable.isRequired(pri))
+		{
+			regiontable.setRequired(pri);
+			reqregioncount++;
+		}
+		if (0 != setChunkRequired(*chunk, chunktable, tiletable, mp, reqchunkcount))
+			return -1;
+	}
+	reqtilecount = tiletable.reqcount;
+	return 0;
+}
 
 
 
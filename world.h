@@ -22,6 +22,7 @@
 
 #include "map.h"
 #include "tables.h"
+#include "manifest.h"
 
 
 // see whether the input world is in region format
@@ -33,7 +34,8 @@ bool detectRegionFormat(const std::string& inputdir);
 // returns false if the world is too big to fit in one of the tables
 // if mp.baseZoom is set to -1 coming in, then this function will set it to the smallest zoom
 //  that can fit everything
-bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+// the headers of all the regions are recorded in the manifest
+bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, WorldManifest& manifest);
 
 // read a list of region filenames from a file; set the regions to required in the RegionTable; set the chunks they
 //  contain to required in the ChunkTable; set all tiles touched by those chunks to required in the TileTable
@@ -42,7 +44,17 @@ bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable,
 //  even if ".mcr" was used in this regionlist
 // returns 0 on success, -1 if baseZoom is too small, -2 for other errors (can't read regionlist, world too big
 //  for our internal data structures, etc.)
-int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+// only the chunks in the listed regions that have changed since the manifest from the last render (previous)
+//  are set required--a listed region that isn't in the manifest has all its chunks drawn
+// the headers of the listed regions are recorded in current
+int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, const WorldManifest& previous, WorldManifest& current);
+
+// find all regions on disk, and compare their headers against the manifest from the last render; set the chunks
+//  that have changed since (including deleted ones) to required in the ChunkTable, their regions to required in
+//  the RegionTable, and all tiles touched by them to required in the TileTable
+// the headers of all the regions are recorded in current
+// returns 0 on success, -1 if baseZoom is too small, -2 for other errors
+int findChangedChunks(const std::string& inputdir, const WorldManifest& previous, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, WorldManifest& current);
 
 
 // find all chunks on disk, set them to required in the ChunkTable, and set all tiles they
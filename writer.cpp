@@ -0,0 +1,165 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <iostream>
+
+#include "writer.h"
+
+using namespace std;
+
+
+
+void *runEncoderThread(void *arg)
+{
+	TileWriter *tw = (TileWriter*)arg;
+	TileWriter::WriteJob job;
+	while (tw->nextJob(job))
+	{
+		bool success = job.img->writeImage(job.filename);
+		if (!success)
+			cerr << "failed to write " << job.filename << endl;
+		tw->finishJob(job, success);
+	}
+	return 0;
+}
+
+TileWriter::TileWriter(int numthreads)
+	: maxbuffers(numthreads * (WRITEQUEUEPERTHREAD + 1)), stopping(true), threads(numthreads), started(numthreads, false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&bufferfree, NULL);
+	pthread_cond_init(&workready, NULL);
+}
+
+TileWriter::~TileWriter()
+{
+	stop();
+	for (vector<RGBAImage*>::iterator it = allbuffers.begin(); it != allbuffers.end(); it++)
+		delete *it;
+	pthread_cond_destroy(&workready);
+	pthread_cond_destroy(&bufferfree);
+	pthread_mutex_destroy(&mutex);
+}
+
+void TileWriter::start()
+{
+	stopping = false;
+	bool any = false;
+	for (int i = 0; i < (int)threads.size(); i++)
+	{
+		started[i] = 0 == pthread_create(&threads[i], NULL, runEncoderThread, (void*)this);
+		if (!started[i])
+			cerr << "failed to create encoder thread!" << endl;
+		any = any || started[i];
+	}
+	// with no encoders, the render threads will have to write their own tiles
+	if (!any)
+		stopping = true;
+}
+
+TileWriterStats TileWriter::stop()
+{
+	{
+		mutexLocker ml(mutex);
+		stopping = true;
+		pthread_cond_broadcast(&workready);
+	}
+	// the threads drain the queue before they exit...
+	for (int i = 0; i < (int)threads.size(); i++)
+		if (started[i])
+		{
+			pthread_join(threads[i], NULL);
+			started[i] = false;
+		}
+	// ...but if none of them could be started, we'll have to do it ourselves
+	WriteJob job;
+	while (nextJob(job))
+	{
+		bool success = job.img->writeImage(job.filename);
+		if (!success)
+			cerr << "failed to write " << job.filename << endl;
+		finishJob(job, success);
+	}
+	return stats;
+}
+
+void TileWriter::write(const RGBAImage& img, const string& filename)
+{
+	WriteJob job;
+	{
+		mutexLocker ml(mutex);
+		// (if the encoder threads aren't running, we'll just write the tile ourselves)
+		if (freebuffers.empty() && (int)allbuffers.size() >= maxbuffers && !stopping)
+		{
+			stats.stalls++;
+			while (freebuffers.empty() && !stopping)
+				pthread_cond_wait(&bufferfree, &mutex);
+		}
+		if (freebuffers.empty())
+		{
+			allbuffers.push_back(new RGBAImage);
+			freebuffers.push_back(allbuffers.back());
+			stats.buffers++;
+		}
+		job.img = freebuffers.back();
+		freebuffers.pop_back();
+	}
+
+	// the copy reuses the buffer's memory, since all the tiles are the same size
+	*job.img = img;
+	job.filename = filename;
+
+	bool inline_write;
+	{
+		mutexLocker ml(mutex);
+		inline_write = stopping;
+		if (!inline_write)
+		{
+			queue.push_back(job);
+			pthread_cond_signal(&workready);
+		}
+	}
+	if (inline_write)
+	{
+		bool success = job.img->writeImage(job.filename);
+		if (!success)
+			cerr << "failed to write " << job.filename << endl;
+		finishJob(job, success);
+	}
+}
+
+bool TileWriter::nextJob(WriteJob& job)
+{
+	mutexLocker ml(mutex);
+	while (queue.empty() && !stopping)
+		pthread_cond_wait(&workready, &mutex);
+	if (queue.empty())
+		return false;
+	job = queue.front();
+	queue.pop_front();
+	return true;
+}
+
+void TileWriter::finishJob(WriteJob& job, bool success)
+{
+	mutexLocker ml(mutex);
+	if (success)
+		stats.written++;
+	else
+		stats.failed++;
+	freebuffers.push_back(job.img);
+	job.img = NULL;
+	pthread_cond_signal(&bufferfree);
+}
@@ -0,0 +1,84 @@
+// This file is part of pigmap.
+//
+// pigmap is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// pigmap is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rgba.h"
+#include "utils.h"
+
+
+#define WRITEQUEUEPERTHREAD 4  // finished tiles that may wait in the queue, per encoder thread
+
+
+struct TileWriterStats
+{
+	int64_t written;  // tiles encoded and written
+	int64_t failed;  // tiles that couldn't be written
+	int64_t stalls;  // times a render thread had to wait for a free buffer
+	int64_t buffers;  // image buffers allocated (the rest were reused)
+
+	TileWriterStats() : written(0), failed(0), stalls(0), buffers(0) {}
+};
+
+// a pool of threads that encode finished tile images (PNG and/or JPEG) and write them to disk, so the
+//  render threads don't have to wait for libpng/libjpeg
+// ...the render threads copy their tiles into buffers from a fixed-size pool; when all the buffers are
+//  in use (i.e. the encoders are falling behind), the render threads block until one is returned
+struct TileWriter : private nocopy
+{
+	struct WriteJob
+	{
+		RGBAImage *img;
+		std::string filename;  // without extension, as for RGBAImage::writeImage
+	};
+
+	int maxbuffers;  // queued + being encoded
+	std::vector<RGBAImage*> allbuffers, freebuffers;
+	std::deque<WriteJob> queue;
+	bool stopping;  // also set if the threads aren't running, in which case write() does the writing
+
+	pthread_mutex_t mutex;
+	pthread_cond_t bufferfree;  // render threads wait here for a buffer
+	pthread_cond_t workready;  // encoder threads wait here for a tile
+
+	std::vector<pthread_t> threads;
+	std::vector<bool> started;
+	TileWriterStats stats;
+
+	TileWriter(int numthreads);
+	~TileWriter();  // stops the threads, if they're still running
+
+	void start();
+	// write out everything that's still queued, then stop the threads; returns the stats
+	TileWriterStats stop();
+
+	// copy an image into the queue to be written; blocks if there are no free buffers
+	void write(const RGBAImage& img, const std::string& filename);
+
+	// for the encoder threads: get the next tile to write, or false if stopping and the queue is empty
+	bool nextJob(WriteJob& job);
+	// give a buffer back to the pool once it has been written
+	void finishJob(WriteJob& job, bool success);
+};
+
+
+#endif // WRITER_H